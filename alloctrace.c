@@ -0,0 +1,83 @@
+/* alloctrace.c - Allocation trace recorder for Mink.
+ *
+ * Copyright (c)2018 Ross Bamford. See LICENSE for details.
+ */
+
+#ifdef ALLOC_TRACE
+#include "alloctrace.h"
+#include "hal.h"
+#include "vsprintf.h"
+
+#ifndef SERIAL_DEBUG
+#error "ALLOC_TRACE streams over the serial console - build with SERIAL_DEBUG."
+#endif
+
+#define TRACE_RING_SIZE 2048   /* Events. Must be a power of two. */
+
+typedef struct trace_event {
+  char op;
+  uint32_t size, addr, arg, time;
+} trace_event_t;
+
+static trace_event_t ring[TRACE_RING_SIZE];
+static unsigned head, tail;   /* Free-running; wrapped on use. */
+static unsigned dropped;      /* Events lost since the ring filled. */
+static spinlock_t lock = SPINLOCK_RELEASED;
+
+void serial_writestring(const char *data);
+
+/* Add an event to the ring. Call with the lock held and space free. */
+static void push_locked(char op, uint32_t size, uint32_t addr, uint32_t arg) {
+  trace_event_t *e = &ring[head++ & (TRACE_RING_SIZE - 1)];
+  e->op = op;
+  e->size = size;
+  e->addr = addr;
+  e->arg = arg;
+  e->time = (uint32_t)uptime_jiffies();
+}
+
+void alloc_trace(char op, unsigned size, uintptr_t addr, uintptr_t arg) {
+  spinlock_acquire(&lock);
+  /* Once there's room again, note how many events were lost, so the
+     marker sits where the gap is. */
+  if (dropped && head - tail < TRACE_RING_SIZE) {
+    push_locked(TRACE_DROPPED, dropped, 0, 0);
+    dropped = 0;
+  }
+  if (head - tail == TRACE_RING_SIZE)
+    ++dropped;
+  else
+    push_locked(op, size, addr, arg);
+  spinlock_release(&lock);
+}
+
+static void write_line(char *buf, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vsprintf(buf, fmt, args);
+  va_end(args);
+  serial_writestring(buf);
+}
+
+unsigned alloc_trace_flush(unsigned max) {
+  char buf[64];
+  unsigned n = 0;
+
+  while (n < max) {
+    spinlock_acquire(&lock);
+    if (head == tail) {
+      spinlock_release(&lock);
+      break;
+    }
+    trace_event_t e = ring[tail++ & (TRACE_RING_SIZE - 1)];
+    spinlock_release(&lock);
+
+    /* The serial port is slow, so write without the lock held. */
+    write_line(buf, "T%c %x %x %x %x\n", e.op, e.size, e.addr, e.arg,
+               e.time);
+    ++n;
+  }
+  return n;
+}
+
+#endif
@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 #include "hal.h"
+#include "alloctrace.h"
 #include "sys.h"
 #include "x86/vgaterm.h"
 #include "utils.h"
@@ -31,15 +32,26 @@ int get_num_cpucores() {
   return 1;
 }
 
+// TODO implement this properly too, once we bring up the APs!
+int get_current_cpucore() {
+  return 0;
+}
+
 noreturn void idle() {
   for (;;) {
-    __asm__ volatile("hlt");
+    /* Spend idle time pre-zeroing pages and streaming out the allocation
+       trace, and only halt once there's nothing left to do. The next
+       interrupt will wake us up again. */
+    if (refill_zero_pool() == 0 && alloc_trace_flush(8) == 0)
+      __asm__ volatile("hlt");
   }
 }
 
 noreturn void die() {
   disable_interrupts();
-  idle();
+  for (;;) {
+    __asm__ volatile("hlt");
+  }
 }
 
 void print_stack_trace() {
@@ -52,6 +64,20 @@ void print_stack_trace() {
   }
 }
 
+unsigned get_stack_trace(uintptr_t *pcs, unsigned max, unsigned skip) {
+  uint32_t *ebp;
+  unsigned n = 0;
+  __asm__ volatile ("mov %%ebp, %0" : "=r" (ebp));
+  while (ebp && n < max) {
+    if (skip)
+      --skip;
+    else
+      pcs[n++] = ebp[1];
+    ebp = (uint32_t*) *ebp;
+  }
+  return n;
+}
+
 elf_t* get_kernel_elf() {
   return &kernel_elf;
 }
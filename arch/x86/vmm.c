@@ -11,6 +11,7 @@
 #include "mmap.h"
 #include "sys.h"
 #include "utils.h"
+#include "vmspace.h"
 
 #if defined(KDEBUG_ENABLED) && defined(KDEBUG_VMM)
 # define dbg(args...) printk("vmm: " args)
@@ -128,21 +129,21 @@ This function firstly gets a pointer to the page directory using the ``MMAP_PAGE
 
 TODO symbiotic relationship between vmm and pmm {*/
 
-static void ensure_page_table_mapped(uintptr_t v) {
+static int ensure_page_table_mapped(uintptr_t v) {
   if (((*PAGE_DIR_ENTRY(RPDT_BASE, v)) & X86_PRESENT) == 0) {
     dbg("ensure_page_table_mapped: alloc_page!\n");
-    uint64_t p = alloc_page(PAGE_REQ_UNDER4GB);
+    /* The new table must be zeroed - ask the PMM for a page that already is.
+       Page tables may dip into the PMM's emergency reserve, so we can still
+       map memory (and free it again) when memory is tight. */
+    uint64_t p = alloc_page(PAGE_REQ_UNDER4GB | PAGE_REQ_ZERO |
+                            PAGE_REQ_RESERVE);
     dbg("alloc_page finished!\n");
     if (p == ~0ULL)
-      panic("alloc_page failed in map()!");
+      return -1;
 
     *PAGE_DIR_ENTRY(RPDT_BASE, v) = p | X86_PRESENT | X86_WRITE | X86_USER;
-
-    /* Ensure that the new table is set to zero first! */
-    v = (v >> 22) << 22; /* Clear the lower 22 bits. */
-    
-    memset(PAGE_TABLE_ENTRY(RPDT_BASE, v), 0, 0x1000);
   }
+  return 0;
 }
 
 /** The next helper function merely performs a mapping of one page. You can ignore the code referring to "cow" (copy-on-write) - we'll get back to that in a later chapter! { */
@@ -157,7 +158,10 @@ static int map_one_page(uintptr_t v, uint64_t p, unsigned flags) {
     flags &= ~PAGE_WRITE;
   }
 
-  ensure_page_table_mapped(v);
+  if (ensure_page_table_mapped(v) == -1) {
+    spinlock_release(&current->lock);
+    return -1;
+  }
   dbg("map: Made sure page table was mapped.\n");
 
   if (*PAGE_TABLE_ENTRY(RPDT_BASE, v) & X86_PRESENT) {
@@ -256,6 +260,12 @@ static int page_fault(isr_regs_t *regs) {
   /* Get the faulting address from the %cr2 register. */
   uint32_t cr2 = read_cr2();
 
+  /* Not-present faults may just be the first touch of a demand-paged
+     vmspace region (bit 2 of the error code means a user-mode access). */
+  if ((regs->err_code & 1) == 0 &&
+      vmspace_handle_fault(cr2, regs->err_code & 4) == 0)
+    return 0;
+
   /** Ignore this copy-on-write stuff for now. { */
   //if (cow_handle_page_fault(cr2, regs->err_code))
   //  return 0;
@@ -267,6 +277,42 @@ static int page_fault(isr_regs_t *regs) {
   return 0;
 }
 
+/** ``zero_physical_page()`` zeroes a page of physical memory that isn't
+    necessarily mapped anywhere. It points a per-CPU scratch page at it and
+    clears it with ``rep stosl``.
+
+    Page tables for the whole of kernel space are allocated up front (see
+    ``init_virtual_memory()``), so we can write the scratch entry directly
+    without taking the address space lock. That matters, because the PMM
+    may call this from inside ``map()`` via ``ensure_page_table_mapped()``. { */
+
+void zero_physical_page(uint64_t p) {
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+
+  uintptr_t v = MMAP_ZERO_WINDOWS + get_current_cpucore() * PAGE_SIZE;
+  if (v >= MMAP_ZERO_WINDOWS_END)
+    panic("zero_physical_page: no scratch page for this CPU!");
+
+  uint32_t *pte = PAGE_TABLE_ENTRY(RPDT_BASE, v);
+  uintptr_t *pv = (uintptr_t*)v;
+
+  *pte = (p & 0xFFFFF000) | X86_PRESENT | X86_WRITE;
+  __asm__ volatile("invlpg %0" : : "m" (*pv));
+
+  uintptr_t dst = v, count = PAGE_SIZE / 4;
+  __asm__ volatile("rep stosl"
+                   : "+D" (dst), "+c" (count)
+                   : "a" (0)
+                   : "memory");
+
+  *pte = 0;
+  __asm__ volatile("invlpg %0" : : "m" (*pv));
+
+  if (interrupts)
+    enable_interrupts();
+}
+
 /** The ``iterate_mappings()``, ``get_mapping()`` and ``is_mapped()`` functions
     are convenience functions for the rest of the kernel, and are pretty simple. I'm not going to bother explaining them :) { */
 
@@ -372,7 +418,7 @@ int clone_address_space(address_space_t *dest, int make_cow) {
   spinlock_acquire(&global_vmm_lock);
 
   /* Allocate a page for the new page directory */
-  uint32_t p = alloc_page(PAGE_REQ_NONE);
+  uint32_t p = alloc_page(PAGE_REQ_UNDER4GB | PAGE_REQ_RESERVE);
   
   spinlock_init(&dest->lock);
   dest->directory = (uint32_t*)p;
@@ -402,7 +448,7 @@ int clone_address_space(address_space_t *dest, int make_cow) {
     if ((*PAGE_DIR_ENTRY(RPDT_BASE, i) & X86_PRESENT) && is_user) {
       dbg("here2\n");
       /* Create a new page table. */
-      uint32_t p2 = alloc_page(PAGE_REQ_UNDER4GB);
+      uint32_t p2 = alloc_page(PAGE_REQ_UNDER4GB | PAGE_REQ_RESERVE);
       *PAGE_DIR_ENTRY(RPDT_BASE2, i) = p2 | X86_WRITE | X86_USER | X86_PRESENT;
 
       /* Copy every contained page table entry over. */
@@ -2,53 +2,147 @@
  *
  * This file is taken directly from James Malloy's JMTK tutorial
  * code. Copyright (c)2012 James Molloy.
+ *
+ * Word-at-a-time operations and summary level copyright (c)2018 Ross
+ * Bamford. See LICENSE for details.
  */
 #include "adt/bitmap.h"
-#include "hal.h"
 #include "sys.h"
 #include "assert.h"
 
-/* Returns the index of the least significant bit that is set in byte.
-   If byte == 0, the behaviour is undefined. */
-static int lsb_set(uint8_t byte) {
-  int i = 0;
-  /* FIXME: Surely something in Hacker's delight could speed this up? */
-  while ((byte & 1) == 0) {
-    ++i;
-    byte >>= 1;
-  }
-  return i;
+#define WORD_IDX(idx)  ((idx) / BITMAP_WORD_BITS)
+#define WORD_BIT(idx)  ((bitmap_word_t)1 << ((idx) % BITMAP_WORD_BITS))
+#define ALL_ONES       (~(bitmap_word_t)0)
+
+/* Returns the index of the least significant bit that is set in word.
+   If word == 0, the behaviour is undefined. */
+static inline unsigned lsb_set(bitmap_word_t word) {
+  return __builtin_ctzl(word);
+}
+
+static inline unsigned calc_nwords(int64_t max_extent) {
+  return max_extent / BITMAP_WORD_BITS + 1;
+}
+
+static inline unsigned calc_nsummary(unsigned nwords) {
+  return (nwords + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+size_t bitmap_calc_size(int64_t max_extent, int summary) {
+  unsigned nwords = calc_nwords(max_extent);
+  if (summary)
+    nwords += calc_nsummary(nwords);
+  return nwords * sizeof(bitmap_word_t);
 }
 
 void bitmap_init(bitmap_t *xb, uint8_t *storage, int64_t max_extent) {
+  assert(((uintptr_t)storage & (sizeof(bitmap_word_t) - 1)) == 0 &&
+         "bitmap storage must be word aligned!");
   xb->max_extent = max_extent;
-  xb->data = storage;
+  xb->nwords = calc_nwords(max_extent);
+  xb->data = (bitmap_word_t*)storage;
+  xb->summary = NULL;
+
+  memset(xb->data, 0, bitmap_calc_size(max_extent, 0));
+}
+
+void bitmap_init_summary(bitmap_t *xb, uint8_t *storage, int64_t max_extent) {
+  bitmap_init(xb, storage, max_extent);
+  xb->summary = xb->data + xb->nwords;
 
-  memset(xb->data, 0, max_extent / 8 + 1);
+  memset(xb->summary, 0, calc_nsummary(xb->nwords) * sizeof(bitmap_word_t));
 }
 
 void bitmap_set(bitmap_t *xb, unsigned idx) {
-  xb->data[idx/8] |= (1 << (idx%8));
-  assert(bitmap_isset(xb, idx));
+  assert(idx <= xb->max_extent);
+  unsigned w = WORD_IDX(idx);
+  xb->data[w] |= WORD_BIT(idx);
+  if (xb->summary)
+    xb->summary[WORD_IDX(w)] |= WORD_BIT(w);
 }
 
 void bitmap_clear(bitmap_t *xb, unsigned idx) {
-  xb->data[idx/8] &= ~(1 << (idx%8));
+  assert(idx <= xb->max_extent);
+  unsigned w = WORD_IDX(idx);
+  xb->data[w] &= ~WORD_BIT(idx);
+  if (xb->summary && xb->data[w] == 0)
+    xb->summary[WORD_IDX(w)] &= ~WORD_BIT(w);
 }
 
 int bitmap_isset(bitmap_t *xb, unsigned idx) {
-  return (xb->data[idx/8] & (1 << (idx%8))) ? 1 : 0;
+  return (xb->data[WORD_IDX(idx)] & WORD_BIT(idx)) ? 1 : 0;
 }
 int bitmap_isclear(bitmap_t *xb, unsigned idx) {
   return !bitmap_isset(xb, idx);
 }
 
+/* Return the index of the first nonzero data word at or after word 'w',
+   or xb->nwords if there is none. */
+static unsigned next_nonzero_word(bitmap_t *xb, unsigned w) {
+  if (w >= xb->nwords)
+    return xb->nwords;
+
+  if (xb->summary == NULL) {
+    while (w < xb->nwords && xb->data[w] == 0)
+      ++w;
+    return w;
+  }
+
+  /* Use the summary level to skip runs of zero words. */
+  unsigned nsummary = calc_nsummary(xb->nwords);
+  unsigned s = WORD_IDX(w);
+  bitmap_word_t bits = xb->summary[s] & (ALL_ONES << (w % BITMAP_WORD_BITS));
+  while (bits == 0) {
+    if (++s >= nsummary)
+      return xb->nwords;
+    bits = xb->summary[s];
+  }
+  return s * BITMAP_WORD_BITS + lsb_set(bits);
+}
+
 int64_t bitmap_first_set(bitmap_t *xb) {
-  for (uint64_t i = 0; i < (xb->max_extent >> 3) + 1ULL; i ++) {
-    if (xb->data[i] == 0) continue;
+  return bitmap_next_set(xb, 0);
+}
 
-    int64_t idx = i * 8 + lsb_set(xb->data[i]);
-    return (idx > xb->max_extent) ? -1 : idx;
+int64_t bitmap_next_set(bitmap_t *xb, int64_t from) {
+  if (from < 0)
+    from = 0;
+  if (from > xb->max_extent)
+    return -1;
+
+  unsigned w = WORD_IDX(from);
+  bitmap_word_t word = xb->data[w] & (ALL_ONES << (from % BITMAP_WORD_BITS));
+
+  if (word == 0) {
+    w = next_nonzero_word(xb, w + 1);
+    if (w >= xb->nwords)
+      return -1;
+    word = xb->data[w];
   }
-  return -1;
+
+  int64_t idx = (int64_t)w * BITMAP_WORD_BITS + lsb_set(word);
+  return (idx > xb->max_extent) ? -1 : idx;
+}
+
+int64_t bitmap_first_clear(bitmap_t *xb) {
+  return bitmap_next_clear(xb, 0);
+}
+
+int64_t bitmap_next_clear(bitmap_t *xb, int64_t from) {
+  if (from < 0)
+    from = 0;
+  if (from > xb->max_extent)
+    return -1;
+
+  unsigned w = WORD_IDX(from);
+  bitmap_word_t word = ~xb->data[w] & (ALL_ONES << (from % BITMAP_WORD_BITS));
+
+  while (word == 0) {
+    if (++w >= xb->nwords)
+      return -1;
+    word = ~xb->data[w];
+  }
+
+  int64_t idx = (int64_t)w * BITMAP_WORD_BITS + lsb_set(word);
+  return (idx > xb->max_extent) ? -1 : idx;
 }
@@ -23,10 +23,35 @@ static unsigned log2_roundup(unsigned n) {
   return l2+1;
 }
 
+/* Mark block 'idx' of the given order free, keeping the bookkeeping in
+   step with the bitmap. */
+static inline void mark_free(buddy_t *bd, unsigned order_idx, unsigned idx) {
+  assert(bitmap_isclear(&bd->orders[order_idx], idx) && "Double free!");
+  bitmap_set(&bd->orders[order_idx], idx);
+
+  ++bd->nfree[order_idx];
+  bd->free += 1U << order_idx;
+  bd->nonempty |= 1U << order_idx;
+  if (idx < bd->hint[order_idx])
+    bd->hint[order_idx] = idx;
+}
+
+/* Mark block 'idx' of the given order as no longer free. */
+static inline void mark_used(buddy_t *bd, unsigned order_idx, unsigned idx) {
+  bitmap_clear(&bd->orders[order_idx], idx);
+
+  bd->free -= 1U << order_idx;
+  if (--bd->nfree[order_idx] == 0)
+    bd->nonempty &= ~(1U << order_idx);
+}
+
+/* Free a block and coalesce it with its buddies as far as possible. */
+static void free_block(buddy_t *bd, uint64_t addr, unsigned sz);
+
 size_t buddy_calc_overhead(range_t r) {
   size_t accum = 0;
   for (unsigned i = MIN_BUDDY_SZ_LOG2; i <= MAX_BUDDY_SZ_LOG2; ++i)
-    accum += (r.extent >> i) / 8 + 1;
+    accum += bitmap_calc_size(r.extent >> i, /*summary=*/1);
   return accum;
 }
 
@@ -37,9 +62,15 @@ int buddy_init(buddy_t *bd, uint8_t *overhead_storage,
 
   for (unsigned i = 0; i < NUM_BUDDY_BUCKETS; ++i) {
     unsigned idx = bd->size >> (MIN_BUDDY_SZ_LOG2 + i);
-    bitmap_init(&bd->orders[i], overhead_storage, idx);
-    overhead_storage += idx / 8 + 1;
+    bitmap_init_summary(&bd->orders[i], overhead_storage, idx);
+    overhead_storage += bitmap_calc_size(idx, /*summary=*/1);
+
+    bd->nfree[i] = 0;
+    bd->hint[i] = 0;
   }
+  bd->nonempty = 0;
+  bd->total = bd->free = 0;
+  bd->nallocs = bd->nfrees = bd->nfailures = 0;
 
   if (start_freed != 0)
     buddy_free_range(bd, r);
@@ -48,50 +79,56 @@ int buddy_init(buddy_t *bd, uint8_t *overhead_storage,
 }
 
 uint64_t buddy_alloc(buddy_t *bd, unsigned sz) {
+  return buddy_alloc_aligned(bd, sz, 0);
+}
+
+uint64_t buddy_alloc_aligned(buddy_t *bd, unsigned sz, unsigned align_log2) {
 
   unsigned log_sz = log2_roundup(sz);
-  if (log_sz > MAX_BUDDY_SZ_LOG2)
+  if (log_sz > MAX_BUDDY_SZ_LOG2 || align_log2 > MAX_BUDDY_SZ_LOG2)
     panic("buddy_alloc had request that was too large to handle!");
+  if (log_sz < MIN_BUDDY_SZ_LOG2)
+    log_sz = MIN_BUDDY_SZ_LOG2;
 
   unsigned orig_log_sz = log_sz;
 
-  /* Search for a free block - we may have to increase the size of the
-     block to find a free one. */
-  int64_t idx = -1;
-  while (log_sz <= MAX_BUDDY_SZ_LOG2) {
-    int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
-    
-    idx = bitmap_first_set(&bd->orders[order_idx]);
-
-    if (idx != -1)
-      break;
+  /* Blocks are naturally aligned, so asking for a block at least as large
+     as the alignment is enough. The excess is split off and freed below. */
+  if (log_sz < align_log2)
+    log_sz = align_log2;
 
-    ++log_sz;
-  }
-
-  if (idx == -1)
+  /* Find the smallest order >= the one requested that has a free block -
+     we may have to increase the size of the block to find one. */
+  uint32_t avail = bd->nonempty & (~0U << (log_sz - MIN_BUDDY_SZ_LOG2));
+  if (avail == 0) {
     /* No free blocks :( */
+    ++bd->nfailures;
     return ~0ULL;
+  }
 
-  /* We may have to split blocks to get back to a block of the minimum size. */
-  for (; log_sz != orig_log_sz; --log_sz) {
-    int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
+  unsigned order_idx = __builtin_ctz(avail);
+  log_sz = order_idx + MIN_BUDDY_SZ_LOG2;
+
+  int64_t idx = bitmap_next_set(&bd->orders[order_idx], bd->hint[order_idx]);
+  assert(idx != -1 && "buddy free count out of step with bitmap!");
 
-    /* We're splitting a block, so deallocate it first... */
-    bitmap_clear(&bd->orders[order_idx], idx);
+  /* Mark the block as not free. Nothing below it in this order is free
+     either, so the search can start after it next time. */
+  mark_used(bd, order_idx, idx);
+  bd->hint[order_idx] = idx + 1;
+
+  /* We may have to split blocks to get back to a block of the requested
+     size. Each split keeps the lower half and frees its buddy. */
+  for (; log_sz != orig_log_sz; --log_sz) {
+    order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
 
-    /* Then set both its children as free in the next order. */
     idx = INC_ORDER(idx);
-    bitmap_set(&bd->orders[order_idx-1], idx);
-    bitmap_set(&bd->orders[order_idx-1], idx+1);
+    mark_free(bd, order_idx-1, BUDDY(idx));
   }
 
-  /* Mark the block as not free. */
-  int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
-  bitmap_clear(&bd->orders[order_idx], idx);
-
+  ++bd->nallocs;
   uint64_t addr = bd->start + ((uint64_t)idx << log_sz);
-  return addr;  
+  return addr;
 }
 
 static int aligned_for(uint64_t addr, uintptr_t lg2) {
@@ -122,7 +159,8 @@ void buddy_free_range(buddy_t *bd, range_t range) {
       
       range.extent -= sz;
       range.start += sz;
-      buddy_free(bd, start + bd->start, sz);
+      bd->total += 1U << (i - MIN_BUDDY_SZ_LOG2);
+      free_block(bd, start + bd->start, sz);
       break;
     }
 
@@ -130,6 +168,11 @@ void buddy_free_range(buddy_t *bd, range_t range) {
 }
 
 void buddy_free(buddy_t *bd, uint64_t addr, unsigned sz) {
+  ++bd->nfrees;
+  free_block(bd, addr, sz);
+}
+
+static void free_block(buddy_t *bd, uint64_t addr, unsigned sz) {
   uint64_t offs = addr - bd->start;
   unsigned log_sz = log2_roundup(sz);
   unsigned idx = offs >> log_sz;
@@ -138,7 +181,7 @@ void buddy_free(buddy_t *bd, uint64_t addr, unsigned sz) {
     int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
 
     /* Mark this node free. */
-    bitmap_set(&bd->orders[order_idx], idx);
+    mark_free(bd, order_idx, idx);
 
     /* Can we coalesce up another level? */
     if (log_sz == MAX_BUDDY_SZ_LOG2)
@@ -154,8 +197,8 @@ void buddy_free(buddy_t *bd, uint64_t addr, unsigned sz) {
     /* FIXME: ^^ */
 
     /* Mark them both non free. */
-    bitmap_clear(&bd->orders[order_idx], idx);
-    bitmap_clear(&bd->orders[order_idx], BUDDY(idx));
+    mark_used(bd, order_idx, idx);
+    mark_used(bd, order_idx, BUDDY(idx));
 
     /* Move up an order. */
     idx = DEC_ORDER(idx);
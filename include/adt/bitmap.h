@@ -2,24 +2,51 @@
  *
  * This file is taken directly from James Malloy's JMTK tutorial
  * code. Copyright (c)2012 James Molloy.
+ *
+ * Word-at-a-time operations and summary level copyright (c)2018 Ross
+ * Bamford. See LICENSE for details.
  */
 #ifndef BITMAP_H
 #define BITMAP_H
 
-/* This ADT exposes a statically sized bitmap structure. Initialisation of the type
-   calls the given memory allocator to allocate memory. */
+/* This ADT exposes a statically sized bitmap structure. The caller provides
+   the storage, which must be aligned to (and sized in) native words - use
+   bitmap_calc_size() to find out how much is needed.
+
+   Bits are stored a native word at a time so searches can skip whole words
+   and use the CPU's bit-scan instructions. Optionally, a second-level
+   "summary" bitmap can be kept alongside the data, with one bit per data
+   word that is set whenever that word is nonzero. With a summary, finding
+   the first set bit costs roughly O(words / bits-per-word). */
 
+#include <stddef.h>
 #include <stdint.h>
 
+/* The native word that bits are stored in. */
+typedef unsigned long bitmap_word_t;
+
+#define BITMAP_WORD_BITS (sizeof(bitmap_word_t) * 8)
+
 /* A bitmap type. */
 typedef struct bitmap {
-  uint8_t *data;
-  int64_t max_extent;
+  bitmap_word_t *data;
+  bitmap_word_t *summary;  /* NULL if no summary is kept. */
+  int64_t max_extent;      /* Highest valid index. */
+  unsigned nwords;         /* Number of words in 'data'. */
 } bitmap_t;
 
+/* Return the number of bytes of storage required for a bitmap holding
+   indices 0..max_extent. If 'summary' is nonzero, space for the summary
+   level is included. The result is always a multiple of the word size. */
+size_t bitmap_calc_size(int64_t max_extent, int summary);
 
+/* Initialise a bitmap with no summary level, and clear all bits. */
 void bitmap_init(bitmap_t *xb, uint8_t *storage, int64_t max_extent);
 
+/* Initialise a bitmap with a summary level, and clear all bits. 'storage'
+   must be at least bitmap_calc_size(max_extent, 1) bytes. */
+void bitmap_init_summary(bitmap_t *xb, uint8_t *storage, int64_t max_extent);
+
 /* Sets a bit at index idx. */
 void bitmap_set(bitmap_t *xb, unsigned idx);
 
@@ -36,4 +63,16 @@ int bitmap_isclear(bitmap_t *xb, unsigned idx);
    set at all. */
 int64_t bitmap_first_set(bitmap_t *xb);
 
+/* Return the index of the first bit at or after 'from' that is set, or
+   -1 if there is none. */
+int64_t bitmap_next_set(bitmap_t *xb, int64_t from);
+
+/* Return the index of the first bit that is clear, or -1 if all bits
+   are set. */
+int64_t bitmap_first_clear(bitmap_t *xb);
+
+/* Return the index of the first bit at or after 'from' that is clear, or
+   -1 if there is none. */
+int64_t bitmap_next_clear(bitmap_t *xb, int64_t from);
+
 #endif
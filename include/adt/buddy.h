@@ -9,22 +9,50 @@
 #include <stdint.h>
 #include "adt/bitmap.h"
 
-/* log2 of the maximum buddy node size. */
-#define MAX_BUDDY_SZ_LOG2 28 /* 2^28 = 256MB */
+/* log2 of the maximum buddy node size. This is big enough that large
+   vmspace regions and large-page allocations don't have to be split up
+   artificially. Requests are passed around as 'unsigned', so it must stay
+   below 32. */
+#define MAX_BUDDY_SZ_LOG2 30 /* 2^30 = 1GB */
 /* log2 of the minimum buddy node size. */
 #define MIN_BUDDY_SZ_LOG2 12 /* 2^12 = 4KB */
 
 #define NUM_BUDDY_BUCKETS (MAX_BUDDY_SZ_LOG2 - MIN_BUDDY_SZ_LOG2 + 1)
 
+/* The per-order bitmaps are the source of truth for which blocks are free
+   (and so for coalescing). Alongside them we keep enough bookkeeping that
+   allocation never has to scan an order that has nothing in it:
+
+     'nfree'    is the number of free blocks in each order.
+     'nonempty' has bit i set iff nfree[i] != 0, so the smallest order that
+                can satisfy a request is found with a single bit-scan.
+     'hint'     is a cursor per order - no block below it is free, so the
+                bitmap search starts there rather than at zero.
+
+   The remaining counters are statistics, maintained as we go so they can
+   be read without walking the bitmaps. 'total' and 'free' are in units of
+   the minimum block size; 'total' counts everything that has been handed
+   to the allocator with buddy_free_range(). */
 typedef struct buddy {
   uint64_t start, size;
   bitmap_t orders[NUM_BUDDY_BUCKETS];
+  unsigned nfree[NUM_BUDDY_BUCKETS];
+  unsigned hint[NUM_BUDDY_BUCKETS];
+  uint32_t nonempty;
+
+  unsigned total, free;
+  unsigned nallocs, nfrees, nfailures;
 } buddy_t;
 
 size_t buddy_calc_overhead(range_t r);
 int buddy_init(buddy_t *bd, uint8_t *overhead_storage,
                range_t r, int start_freed);
 uint64_t buddy_alloc(buddy_t *bd, unsigned sz);
+/* As buddy_alloc(), but the returned address is also aligned to
+   2^align_log2 bytes (relative to the start of the allocator's range,
+   which callers keep suitably aligned). The block is still 'sz' rounded up
+   to a power of two, so it is freed with buddy_free() as usual. */
+uint64_t buddy_alloc_aligned(buddy_t *bd, unsigned sz, unsigned align_log2);
 void buddy_free_range(buddy_t *bd, range_t range);
 void buddy_free(buddy_t *bd, uint64_t addr, unsigned sz);
 
@@ -0,0 +1,41 @@
+/* alloctrace.h - Allocation trace recorder for Mink.
+ *
+ * Copyright (c)2018 Ross Bamford. See LICENSE for details.
+ */
+#ifndef __MINK_ALLOCTRACE_H
+#define __MINK_ALLOCTRACE_H
+
+#include <stdint.h>
+
+/* When built with ALLOC_TRACE (which needs SERIAL_DEBUG too), every heap
+   and page allocator call is recorded in a ring buffer, which the idle
+   loop streams out over the serial console, one event per line:
+
+     T<op> <size> <addr> <arg> <time>
+
+   with each field in hex and the time in jiffies. tests/replay_alloc.c
+   replays such a log against the host build of the allocators. If the
+   ring fills up, events are dropped, and a TRACE_DROPPED event with the
+   count in its size field marks the gap. */
+
+/* Event types, and what their fields hold. */
+#define TRACE_KMALLOC   'm'  /* size, address, KM_* flags */
+#define TRACE_KALIGNED  'a'  /* size, address, alignment */
+#define TRACE_KREALLOC  'r'  /* size, new address, old address */
+#define TRACE_KFREE     'f'  /* 0, address, 0 */
+#define TRACE_PAGES     'p'  /* page count, first page frame, PAGE_REQ_* */
+#define TRACE_FREEPAGES 'q'  /* page count, first page frame, 0 */
+#define TRACE_DROPPED   '!'  /* events lost, 0, 0 */
+
+#ifdef ALLOC_TRACE
+/* Record an event. Safe to call with any lock held. */
+void alloc_trace(char op, unsigned size, uintptr_t addr, uintptr_t arg);
+/* Write out up to 'max' recorded events, returning how many were
+   written. */
+unsigned alloc_trace_flush(unsigned max);
+#else
+#define alloc_trace(op, size, addr, arg) ((void)0)
+#define alloc_trace_flush(max) 0
+#endif
+
+#endif
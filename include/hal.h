@@ -78,6 +78,12 @@ void uninstall_isr(unsigned int num);
  */
 int get_num_cpucores();
 
+/**
+ * Get the index (0 .. get_num_cpucores()-1) of the CPU core we are
+ * currently running on. Only meaningful with interrupts disabled.
+ */
+int get_current_cpucore();
+
 /**
  * Idle CPU (never returns) 
  */
@@ -121,6 +127,13 @@ void outportb (unsigned short _port, unsigned char _data);
 #define PAGE_REQ_NONE     0 /* No requirements on page location */
 #define PAGE_REQ_UNDER1MB 1 /* Require that the returned page be < 0x100000 */
 #define PAGE_REQ_UNDER4GB 2 /* Require that the returned page be < 0x10000000 */
+#define PAGE_REQ_ZONE_MASK 0xFF
+
+#define PAGE_REQ_ZERO 0x100 /* Flag - may be OR'd with one of the above to
+                               require that the returned page(s) be zeroed */
+#define PAGE_REQ_RESERVE 0x200 /* Flag - allow the allocation to use the
+                                  emergency reserve. Only for allocations
+                                  that must not fail, such as page tables. */
 
 /* Returns the (default) page size in bytes. Not all pages may be this size
    (large pages etc.) */
@@ -139,13 +152,45 @@ uint64_t early_alloc_page();
    failure.
 
    'req' is one of the 'PAGE_REQ_*' flags, indicating a requirement on the
-   address of the returned page. */
+   address of the returned page, optionally OR'd with PAGE_REQ_ZERO and/or
+   PAGE_REQ_RESERVE. If the requested zone is short, the allocation may be
+   satisfied from a lower zone (4GB+ falls back to <4GB). Zeroed
+   pages are taken from a pool that is filled while the CPU is idle where
+   possible, otherwise they are zeroed before returning. */
 uint64_t alloc_page(int req);
 /* Mark a physical page as free. Returns -1 on failure. */
 int free_page(uint64_t page);
 
 uint64_t alloc_pages(int req, size_t num);
 int free_pages(uint64_t pages, size_t num);
+/* As alloc_pages(), but the returned address is also aligned to
+   2^align_log2 bytes (alignments below the page size mean page aligned).
+   If the general zones can't satisfy the request, it is taken from the
+   contiguous memory region set aside at boot. Free with free_pages(). */
+uint64_t alloc_pages_aligned(int req, size_t num, unsigned align_log2);
+
+/* Allocate 'num' physical pages that need not be contiguous, storing their
+   addresses in 'pages'. This is much less likely to fail than alloc_pages()
+   when memory is fragmented, and leaves large blocks for those that really
+   need them. Either all pages are allocated or none are; returns -1 on
+   failure. */
+int alloc_pages_bulk(int req, size_t num, uint64_t *pages);
+/* Free 'num' pages previously allocated with alloc_pages_bulk(). */
+int free_pages_bulk(uint64_t *pages, size_t num);
+
+/* Zero a free page and add it to the pool used to satisfy PAGE_REQ_ZERO
+   allocations. This is called from the idle loop; it returns nonzero if a
+   page was added, or zero if there is nothing to do right now. */
+int refill_zero_pool();
+
+/* Fill the physical page 'p' with zeroes. 'p' need not be mapped. */
+void zero_physical_page(uint64_t p);
+
+/* Tune the per-CPU page caches that sit in front of alloc_page() and
+   free_page(). Pages are moved between a cache and the underlying
+   allocator 'batch' at a time, and a cache holding more than 'high' pages
+   is drained back. Returns -1 if the values are out of range. */
+int set_page_cache_params(unsigned batch, unsigned high);
 
 /* Creates a new address space based on the current one and stores it in
    'dest'. If 'make_cow' is nonzero, all pages marked WRITE are modified so
@@ -236,6 +281,9 @@ void spinlock_init(spinlock_t *lock);
 spinlock_t *spinlock_new();
 /* Acquire 'lock', blocking until it is available. */
 void spinlock_acquire(spinlock_t *lock);
+/* Acquire 'lock' if it is available, without blocking. Returns nonzero if
+   it was acquired. */
+int spinlock_try_acquire(spinlock_t *lock);
 /* Release 'lock'. Nonblocking. */
 void spinlock_release(spinlock_t *lock);
 
@@ -368,6 +416,13 @@ elf_t* get_kernel_elf();
  */
 void print_stack_trace();
 
+/**
+ * Store up to 'max' return addresses from the current call stack in 'pcs',
+ * innermost first, after skipping the 'skip' innermost frames (the
+ * caller's own is the first). Returns the number stored.
+ */
+unsigned get_stack_trace(uintptr_t *pcs, unsigned max, unsigned skip);
+
 /**
  * Set the frequency of the core kernel timer. This is an optional operation -
  * architectures are free to ignore it entirely, or take it as a 'hint',
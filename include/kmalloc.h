@@ -7,7 +7,42 @@
 #ifndef __MINK_KMALLOC_H
 #define __MINK_KMALLOC_H
 
+/* Flags for kmalloc_flags(). */
+#define KM_ATOMIC   0x1  /* Don't spin on a busy lock or grow a cache; fail
+                            instead. Only served from the size classes, so
+                            requests above a page, or with KM_UNDER4GB,
+                            always fail. For interrupt handlers. */
+#define KM_ZERO     0x2  /* Zero the memory, using pre-zeroed pages where
+                            possible. */
+#define KM_UNDER4GB 0x4  /* Back with physical memory below 4GB. Always
+                            takes whole pages. */
+#define KM_NOFAIL   0x8  /* Use the emergency reserve if need be, and panic
+                            rather than return NULL. Not with KM_ATOMIC. */
+
 void *kmalloc(unsigned sz);
+/* As kmalloc(), modified by KM_* 'flags'. */
+void *kmalloc_flags(unsigned sz, unsigned flags);
 void kfree(void *p);
 
+/* Allocate 'sz' bytes aligned to 'align', a power of two. Alignments above
+   the page size are only honoured for allocations that fit in a 4MB
+   chunk. The result is freed with kfree(). */
+void *kmalloc_aligned(unsigned sz, unsigned align);
+/* Allocate a zeroed array of 'n' elements of 'sz' bytes. Returns NULL if
+   the size overflows. */
+void *kcalloc(unsigned n, unsigned sz);
+/* Resize the allocation at 'p' to 'sz' bytes, in place where possible,
+   and return its (possibly new) address. Contents up to the smaller of
+   the two sizes are kept. krealloc(NULL, sz) is kmalloc(sz);
+   krealloc(p, 0) frees 'p' and returns NULL. Alignment from
+   kmalloc_aligned() is not kept if the allocation moves. */
+void *krealloc(void *p, unsigned sz);
+
+/* Sample about one allocation per 'rate' bytes for the heap profiler, or
+   none if 'rate' is 0. Sampling is on by default. */
+void kmalloc_profile_set_rate(unsigned rate);
+/* Print the estimated live bytes for each sampled call site, with its
+   symbolised call stack. */
+void kmalloc_profile_dump();
+
 #endif
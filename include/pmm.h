@@ -51,10 +51,55 @@ uint32_t pmm_get_page_count();
 
 /**
  * Determine the number of free pages currently available to the allocator. 
- * This includes both free pages and currently allocated pages.
+ * This includes pages held in the per-CPU page caches and the zero pool.
  */
 uint32_t pmm_get_free_count();
 
+/**
+ * Statistics for a single zone (PAGE_REQ_* value). Page counts are in
+ * pages; 'free' does not include 'cached' or 'zeroed'.
+ */
+typedef struct pmm_zone_stats {
+  uint32_t total;
+  uint32_t free;
+  uint32_t cached;
+  uint32_t zeroed;
+  uint32_t nallocs;
+  uint32_t nfrees;
+  uint32_t nfailures;
+  uint32_t wmark_min;
+  uint32_t wmark_low;
+  uint32_t wmark_high;
+} pmm_zone_stats_t;
+
+/**
+ * Fill _stats_ with the current statistics for zone _req_. The counters
+ * are maintained incrementally, so this is cheap enough to call often.
+ *
+ * Returns:
+ *  0 on success, or -1 if _req_ is not a valid zone.
+ */
+int pmm_get_zone_stats(int req, pmm_zone_stats_t *stats);
+
+/**
+ * Set the watermarks of zone _req_, in pages. General allocations never
+ * take a zone below _min_ (the rest is reserved for PAGE_REQ_RESERVE), and
+ * never take it below _low_ when falling back from a higher zone. Pages
+ * are only taken for background work while the zone is above _high_.
+ *
+ * Returns:
+ *  0 on success, or -1 if _req_ is not a valid zone or the watermarks are
+ *  not in ascending order.
+ */
+int pmm_set_zone_watermarks(int req, unsigned min, unsigned low,
+                            unsigned high);
+
+/**
+ * Print a per-zone summary of physical memory, and a table of the number
+ * of free blocks of each order in each zone (a la /proc/buddyinfo).
+ */
+void pmm_dump_stats();
+
 /**
  * Allocate a page from the free page pool. This page remains the property of
  * the caller until such time as it is returned to the pool via a call to
@@ -9,21 +9,124 @@
 
 #include "vmspace.h"
 
-#define SLAB_SIZE 0x2000
+/* Each cache picks its own slab size - a power of two between these -
+   aiming to waste no more than SLAB_WASTE_PCT percent of each slab. */
+#define SLAB_MIN_SIZE  0x1000
+#define SLAB_MAX_SIZE  0x8000
+#define SLAB_WASTE_PCT 12
 
+#define SLAB_MAX_CPUS     16  /* CPUs above this bypass the magazine layer. */
+#define SLAB_MAG_MAX      64  /* Capacity of a magazine, in objects. */
+#define SLAB_MAG_DEFAULT  16  /* Default number of rounds per magazine. */
+#define SLAB_DEPOT_MAX    8   /* Full magazines the depot may hold. */
+
+#define SLAB_COLOUR_ALIGN 64  /* Cache line size - the unit of slab colour. */
+
+#define SLAB_EMPTY_DEFAULT 2     /* Empty slabs kept per cache, by default. */
+#define SLAB_REAP_INTERVAL 100   /* Ticks between runs of the reaper. */
+#define SLAB_REAP_IDLE     500   /* Ticks an empty slab may stay idle. */
+
+/* Flags for slab_cache_alloc_flags(). */
+#define SLAB_ATOMIC  0x1
+#define SLAB_ZERO    0x2
+#define SLAB_RESERVE 0x4
+
+/* A magazine is a small stack of objects. */
+typedef struct slab_magazine {
+  struct slab_magazine *next;    /* Link in the depot. */
+  unsigned rounds;               /* Number of objects in 'objs'. */
+  unsigned idle_since;           /* Tick at which it entered the depot. */
+  void *objs[SLAB_MAG_MAX];
+} slab_magazine_t;
+
+/* Each CPU has a loaded magazine and the previously loaded one, and only
+   touches the cache's lock to swap them with the depot. */
+typedef struct slab_cpu {
+  slab_magazine_t *loaded, *prev;
+} slab_cpu_t;
+
+/* Object constructor and destructor. The constructor puts an object into
+   its "constructed" state when its slab is created; objects are expected
+   to be back in that state when they are freed, so it is not run again.
+   The destructor is run only when the slab is given back to the vmspace. */
+typedef void (*slab_ctor_t)(void *obj);
+typedef void (*slab_dtor_t)(void *obj);
+
+/* Each slab is kept on exactly one of three lists, according to how many
+   of its objects are in use. Allocation takes from the first partial slab
+   (then from an empty one, then from a new one), and each slab threads a
+   freelist through its own free objects, so neither allocation nor freeing
+   has to search.
+
+   In front of the slabs sits a magazine layer, as in Bonwick's "Magazines
+   and Vmem" paper. Allocations and frees are served from a per-CPU
+   magazine where possible, and full and empty magazines are exchanged
+   with a depot protected by 'lock', so the slabs themselves are only
+   touched when the depot runs dry (or overflows). The depot holds at most
+   SLAB_DEPOT_MAX full magazines - beyond that, magazines are flushed back
+   to the slabs - and the reaper flushes those that sit there idle. */
 typedef struct slab_cache {
   unsigned size;
-  void *init;
-  struct slab_footer *first;
-  void *empty;
+  unsigned stride;               /* Distance between objects. */
+  unsigned link;                 /* Offset of the freelist link in a free
+                                    object - after the object itself if it
+                                    has a constructor, so that its
+                                    constructed state survives. */
+  unsigned slab_size;            /* Bytes per slab. */
+  int offslab;                   /* Slab descriptors are kept off-slab. */
+  unsigned nobjs;                /* Objects per slab. */
+  unsigned colour_max;           /* Largest colour offset that fits. */
+  unsigned colour_next;          /* Colour offset for the next new slab. */
+  slab_ctor_t ctor;
+  slab_dtor_t dtor;
+  struct slab_footer *partial;   /* Some objects in use. */
+  struct slab_footer *full;      /* All objects in use. */
+  struct slab_footer *empty;     /* No objects in use, newest first. */
+  unsigned nempty;
+  unsigned empty_max;            /* Empty slabs to keep rather than destroy. */
   vmspace_t *vms;
 
-  spinlock_t lock;
+  unsigned mag_size;             /* Rounds per magazine; 0 disables. */
+  slab_cpu_t cpus[SLAB_MAX_CPUS];
+  slab_magazine_t *depot_full;   /* Magazines with objects in, newest
+                                    first. */
+  slab_magazine_t *depot_empty;
+  unsigned nfull;                /* Magazines in depot_full. */
+
+  spinlock_t lock;               /* Protects the slab lists and depot. */
+  struct slab_cache *next_cache; /* Link in the list of all caches. */
 } slab_cache_t;
 
-int slab_cache_create(slab_cache_t *c, vmspace_t *vms, unsigned size, void *init);
+int slab_cache_create(slab_cache_t *c, vmspace_t *vms, unsigned size,
+                      slab_ctor_t ctor, slab_dtor_t dtor);
 int slab_cache_destroy(slab_cache_t *c);
 void *slab_cache_alloc(slab_cache_t *c);
+/* Allocate an object as slab_cache_alloc() does, modified by 'flags':
+     SLAB_ATOMIC  - don't wait for the cache lock or grow the cache; fail
+                    instead.
+     SLAB_ZERO    - zero the object. Not for caches with a constructor.
+     SLAB_RESERVE - a new slab may use the PMM's emergency reserve. */
+void *slab_cache_alloc_flags(slab_cache_t *c, unsigned flags);
 void slab_cache_free(slab_cache_t *c, void *obj);
+/* Return the cache that 'obj' was allocated from, or NULL if it isn't in
+   any slab. */
+slab_cache_t *slab_cache_for(void *obj);
+
+/* Set the number of objects each magazine holds, up to SLAB_MAG_MAX. Zero
+   disables the magazine layer, after draining it. Returns -1 if 'rounds'
+   is out of range. */
+int slab_cache_set_magazine_size(slab_cache_t *c, unsigned rounds);
+/* Return every object held in the depot, and in this CPU's magazines, to
+   the slabs. Objects held by other CPUs are left where they are. */
+void slab_cache_drain(slab_cache_t *c);
+
+/* Set the number of empty slabs the cache keeps for reuse, rather than
+   returning them to the vmspace straight away. Excess empty slabs are
+   destroyed. */
+int slab_cache_set_empty_max(slab_cache_t *c, unsigned n);
+/* Flush depot magazines, then destroy empty slabs, in every cache, that
+   have been idle for more than SLAB_REAP_IDLE ticks. Called from
+   kernel_tick() every SLAB_REAP_INTERVAL ticks. */
+void slab_reap();
 
 #endif
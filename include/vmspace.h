@@ -10,16 +10,101 @@
 #include <stdint.h>
 #include "adt/buddy.h"
 
+struct vmspace;
+struct vmspace_node;
+
+/* How a vmspace hands out addresses. VMSPACE_BUDDY regions are rounded up
+   to a power of two and naturally aligned, which kmalloc and the slab
+   allocator rely on. The others keep a balanced tree of regions, each
+   node recording the gap before it and the largest gap in its subtree.
+   Regions are then exact page multiples, may have guard pages, and
+   carry metadata that can be looked up with vmspace_query(). */
+#define VMSPACE_BUDDY    0
+#define VMSPACE_BEST_FIT 1      /* Smallest gap that fits. */
+#define VMSPACE_NEXT_FIT 2      /* First gap at or after the last region. */
+
+/* How a region is backed. */
+#define VMSPACE_RESERVED 0      /* By the caller, with vmspace_map(). */
+#define VMSPACE_WIRED    1      /* Up front, by vmspace_alloc(). */
+#define VMSPACE_LAZY     2      /* A page at a time, on first touch. */
+#define VMSPACE_INTERNAL 3      /* The vmspace's own bookkeeping. */
+
+/* A region of a vmspace. For demand-paged regions this is owned by the
+   caller and must stay put until vmspace_free_lazy(); tree vmspaces keep
+   their own copy, which vmspace_query() hands out. */
+typedef struct vmspace_region {
+  uintptr_t start;
+  unsigned size;
+  unsigned guard;               /* Unmapped bytes either side (tree only). */
+  int backing;                  /* VMSPACE_RESERVED etc. */
+  unsigned flags;               /* Page flags to map with. */
+  int req;                      /* PAGE_REQ_* to allocate with. */
+  unsigned prefault;            /* Extra pages to back after a fault. */
+  struct vmspace *vms;
+  struct vmspace_region *next;
+} vmspace_region_t;
+
 typedef struct vmspace {
   uintptr_t start;
   uintptr_t size;
+  unsigned policy;              /* VMSPACE_BUDDY etc. */
   buddy_t allocator;
+  struct vmspace_node *root;    /* Tree of regions. */
+  struct vmspace_node *spare;   /* Unused tree nodes. */
+  uintptr_t cursor;             /* End of the last region, for next fit. */
   spinlock_t lock;
+  vmspace_region_t *lazy;       /* Demand-paged regions (buddy only). */
+  struct vmspace *next;
 } vmspace_t;
 
 int vmspace_init(vmspace_t *vms, uintptr_t addr, uintptr_t sz);
-uintptr_t vmspace_alloc(vmspace_t *vms, unsigned sz, int alloc_phys);
+/* Initialise a vmspace with one of the tree policies. Its bookkeeping is
+   kept in pages taken from the vmspace itself, as needed. */
+int vmspace_init_tree(vmspace_t *vms, uintptr_t addr, uintptr_t sz,
+                      unsigned policy);
+/* Allocate 'sz' bytes of address space. If 'alloc_phys' is nonzero, back
+   it with physical pages requested with 'req' (PAGE_REQ_*) and mapped with
+   'alloc_phys' as the page flags. Returns ~0 if either runs out. */
+uintptr_t vmspace_alloc(vmspace_t *vms, unsigned sz, int alloc_phys, int req);
 void vmspace_free(vmspace_t *vms, unsigned sz, uintptr_t addr, int free_phys);
+/* Back (or stop backing) part of a region allocated without physical
+   memory. 'addr' and 'sz' must be page aligned. vmspace_map returns -1,
+   mapping nothing, if memory runs out. */
+int vmspace_map(vmspace_t *vms, uintptr_t addr, unsigned sz, unsigned flags,
+                int req);
+void vmspace_unmap(vmspace_t *vms, uintptr_t addr, unsigned sz);
+
+/* Reserve 'sz' bytes of address space as a demand-paged region described
+   by 'r'. Each page is backed on first touch, along with up to 'prefault'
+   following pages of the region. Returns the region's address, or ~0.
+   Nothing may touch the region while holding 'vms's lock. */
+uintptr_t vmspace_alloc_lazy(vmspace_t *vms, vmspace_region_t *r, unsigned sz,
+                             unsigned flags, int req, unsigned prefault);
+/* Release a demand-paged region, and whichever of its pages were backed. */
+void vmspace_free_lazy(vmspace_region_t *r);
+/* Called by the page fault handler for a not-present fault on 'addr'.
+   'user' is nonzero if the access came from user mode. Backs the page if
+   it belongs to a demand-paged region, returning 0, or returns -1 if it
+   doesn't, memory has run out or the vmspace is locked (by the faulting
+   code, perhaps). */
+int vmspace_handle_fault(uintptr_t addr, int user);
+
+/* Tree vmspaces only: allocate a region of 'r->size' bytes (rounded up to
+   a page) with 'r->guard' bytes of unmapped guard either side, backed as
+   'r->backing' says. 'r->start' and 'r->vms' are filled in. Returns the
+   region's address, or ~0. */
+uintptr_t vmspace_alloc_region(vmspace_t *vms, vmspace_region_t *r);
+/* Tree vmspaces only: free the region starting at 'addr'. Its pages are
+   released too, unless it is VMSPACE_RESERVED. */
+void vmspace_free_region(vmspace_t *vms, uintptr_t addr);
+/* Copy out the region containing 'addr' (or its guard pages), returning 0,
+   or -1 if there isn't one. Buddy vmspaces only know their demand-paged
+   regions. */
+int vmspace_query(vmspace_t *vms, uintptr_t addr, vmspace_region_t *out);
+/* As vmspace_query(), but for the first region starting at or after
+   'addr'. Iterate with addr = out->start + out->size. */
+int vmspace_next_region(vmspace_t *vms, uintptr_t addr,
+                        vmspace_region_t *out);
 
 extern vmspace_t kernel_vmspace;
 
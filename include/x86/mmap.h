@@ -18,7 +18,11 @@
                           0xFE800000
 
 #define MMAP_PMM_BITMAP   0xFE800000
-#define MMAP_PMM_BITMAP_END 0xFF800000
+#define MMAP_PMM_BITMAP_END 0xFF7F0000
+
+#define MMAP_ZERO_WINDOWS 0xFF7F0000 /* One scratch page per CPU, used to */
+#define MMAP_ZERO_WINDOWS_END \
+                          0xFF800000 /* zero physical pages. */
 
 #define MMAP_KERNEL_END   0xFF800000
 
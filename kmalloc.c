@@ -5,65 +5,670 @@
  * Copyright (c)2013 Ross Bamford. See LICENSE for details.
  */
 
+#include "alloctrace.h"
 #include "assert.h"
+#include "elf.h"
 #include "hal.h"
 #include "kmalloc.h"
 #include "mmap.h"
 #include "slab.h"
+#include "sys.h"
 #include "vmspace.h"
 #include "utils.h"
 
-#define MAX_CACHESZ_LOG2 9 /* 2**9 = 512 */
-#define MIN_CACHESZ_LOG2 3 /* 2**3 = 8 */
+/* Size classes, roughly 25% apart: 8, then four classes in each power of
+   two from 16 up to KMALLOC_MAX_CLASS. Anything larger is a large
+   allocation. */
+#define NUM_CLASSES 29
+#define KMALLOC_MAX_CLASS 4096
+#define CLASS_GRAIN_LOG2 4
 
-#define KMALLOC_CANARY 0xDEAD12
+/* Large allocations.
+
+   Requests above KMALLOC_MAX_CLASS are served in whole pages from chunks
+   of CHUNK_SIZE bytes of kernel_vmspace. A chunk's first page holds its
+   header, including a map with an entry per page. The first and last pages
+   of every run, allocated or free, are tagged with the run's length, so
+   runs split to the exact page count and coalesce with their neighbours
+   when freed. Only allocated runs are backed by physical memory. Runs
+   backed from below 4GB are tagged as such, so they stay there if they
+   grow.
+
+   Requests too big for a chunk get a region of their own, again with a
+   header page in front. Either way, kfree finds the header by rounding
+   the pointer down to a chunk boundary.
+
+   Allocations can change size in place: runs by taking pages from or
+   giving them back to the run after them, and regions of their own by
+   backing more or less of their reservation. */
+#define CHUNK_SHIFT      22
+#define CHUNK_SIZE       (1U << CHUNK_SHIFT)
+#define CHUNK_PAGE_SHIFT 12
+#define CHUNK_PAGES      (1U << (CHUNK_SHIFT - CHUNK_PAGE_SHIFT))
+#define CHUNK_MAGIC      0xDEAD1200
+
+#define RUN_USED  0x8000
+#define RUN_LOW   0x4000    /* Backed with PAGE_REQ_UNDER4GB pages. */
+#define RUN_FLAGS (RUN_USED|RUN_LOW)
+
+typedef struct chunk {
+  unsigned magic;
+  unsigned npages;          /* Size of a region of its own, or 0 for a
+                               chunk of runs. */
+  unsigned reserved;        /* Bytes reserved for a region of its own. */
+  int req;                  /* PMM zone backing a region of its own. */
+  unsigned nfree;           /* Free pages in the chunk. */
+  struct chunk *next;
+  uint16_t map[CHUNK_PAGES];
+} chunk_t;
+
+#define CHUNK_FOR_PTR(x) ((chunk_t*)((uintptr_t)(x) & ~(uintptr_t)(CHUNK_SIZE-1)))
+#define PAGE_ADDR(c, i) ((uintptr_t)(c) + ((uintptr_t)(i) << CHUNK_PAGE_SHIFT))
+#define NPAGES(sz) (((sz) + (1U << CHUNK_PAGE_SHIFT) - 1) >> CHUNK_PAGE_SHIFT)
+
+#define MIN(x, y) ( (x < y) ? x : y )
+
+/* Heap profiling.
+
+   About one allocation in every kprof_rate bytes is sampled: its call stack
+   is captured, and it is charged to that call site with the number of
+   bytes it stands for. Each site's estimated live bytes are kept in a
+   small fixed table. Sampled allocations are remembered in a hash table,
+   so that freeing one takes its weight off again. Unsampled allocations
+   cost an atomic subtraction. A free only takes the profile lock if its
+   address hashes to a mark that some live sample also holds, so frees of
+   unsampled objects stay lock-free. kmalloc_profile_dump() prints the
+   table. */
+#define KPROF_DEPTH        4
+#define KPROF_SITES        64    /* The last site collects any overflow. */
+#define KPROF_SAMPLES      256   /* Must be a power of two. */
+#define KPROF_MARKS        1024  /* Must be a power of two. */
+#define KPROF_RATE_DEFAULT (512 * 1024)
+
+typedef struct kprof_site {
+  uintptr_t pcs[KPROF_DEPTH];
+  unsigned live;                /* Estimated live bytes. */
+  unsigned nsamples;            /* Allocations sampled here. */
+} kprof_site_t;
+
+typedef struct kprof_sample {
+  void *ptr;
+  unsigned weight;
+  kprof_site_t *site;
+} kprof_sample_t;
+
+static kprof_site_t kprof_sites[KPROF_SITES];
+static kprof_sample_t kprof_samples[KPROF_SAMPLES];
+/* Live samples whose address hashes to each mark. Changed only under
+   kprof_lock, but read without it. */
+static uint8_t kprof_marks[KPROF_MARKS];
+static unsigned kprof_nsamples;
+static unsigned kprof_rate = KPROF_RATE_DEFAULT;
+static int kprof_countdown = KPROF_RATE_DEFAULT;
+static unsigned kprof_seed = 1;
+static spinlock_t kprof_lock = SPINLOCK_RELEASED;
+
+#define KPROF_HASH(p) (((uintptr_t)(p) >> 3) & (KPROF_SAMPLES - 1))
+#define KPROF_MARK(p) (((uintptr_t)(p) >> 3) & (KPROF_MARKS - 1))
 
 vmspace_t kernel_vmspace;
 
-static slab_cache_t caches[MAX_CACHESZ_LOG2-MIN_CACHESZ_LOG2+1];
+static const unsigned class_sizes[NUM_CLASSES] = {
+  8,
+  16,   32,   48,   64,
+  80,   96,   112,  128,
+  160,  192,  224,  256,
+  320,  384,  448,  512,
+  640,  768,  896,  1024,
+  1280, 1536, 1792, 2048,
+  2560, 3072, 3584, 4096
+};
 
-void *kmalloc(unsigned sz) {
-  /* We need to add a small header to the allocation to track which
-     cache (if any) it came from. It must be a multiple of the pointer
-     size in order that the address after it (which we will be returning)
-     has natural alignment. */
-  sz += sizeof(uintptr_t);
+static slab_cache_t caches[NUM_CLASSES];
+
+/* Class index for each size, in units of 1 << CLASS_GRAIN_LOG2 bytes
+   (rounded up). Filled in by kmalloc_init. */
+static uint8_t size_to_class[(KMALLOC_MAX_CLASS >> CLASS_GRAIN_LOG2) + 1];
 
-  uintptr_t *ptr;
+static inline unsigned size_class(unsigned sz) {
+  if (sz <= class_sizes[0])
+    return 0;
+  return size_to_class[(sz + (1U << CLASS_GRAIN_LOG2) - 1) >> CLASS_GRAIN_LOG2];
+}
 
-  unsigned l2 = log2_roundup(sz);
-  if (l2 < MIN_CACHESZ_LOG2) l2 = MIN_CACHESZ_LOG2;
+static chunk_t *chunks;
+static spinlock_t chunks_lock = SPINLOCK_RELEASED;
 
-  if (l2 >= MIN_CACHESZ_LOG2 && l2 <= MAX_CACHESZ_LOG2) {
-    ptr = (uintptr_t*)slab_cache_alloc(&caches[l2-MIN_CACHESZ_LOG2]);
-  } else {
-    /* Get the size as the smallest power of 2 >= sz */
-    unsigned sz_p2 = 1U << l2;
-    if (sz_p2 < get_page_size()) {
-      sz_p2 = get_page_size();
-      l2 = log2_roundup(sz_p2);
+/* Tag the run of 'n' pages from page 'i' of 'c'. */
+static void set_run(chunk_t *c, unsigned i, unsigned n, unsigned used) {
+  c->map[i] = c->map[i + n - 1] = n | used;
+}
+
+/* First fit for a run of 'n' pages in 'c', starting on a multiple of 'a'
+   pages. Returns the index of the free run to carve it from, or 0 if there
+   is none (page 0 is the header), and the start of the fit in 'start'. */
+static unsigned find_run(chunk_t *c, unsigned n, unsigned a, unsigned *start) {
+  for (unsigned i = 1; i < CHUNK_PAGES; i += c->map[i] & ~RUN_FLAGS) {
+    if (c->map[i] & RUN_USED)
+      continue;
+    unsigned j = (i + a - 1) & ~(a - 1);
+    if (j + n <= i + c->map[i]) {
+      *start = j;
+      return i;
     }
+  }
+  return 0;
+}
 
-    ptr = (uintptr_t*)vmspace_alloc(&kernel_vmspace, sz_p2, 1);
+/* Free the run of 'n' pages at page 'i' of 'c', coalescing it with the
+   runs either side. The header keeps page 0 in use. Call with chunks_lock
+   held. */
+static void free_run_locked(chunk_t *c, unsigned i, unsigned n) {
+  c->nfree += n;
+  if (!(c->map[i - 1] & RUN_USED)) {
+    unsigned m = c->map[i - 1];
+    i -= m;
+    n += m;
   }
+  if (i + n < CHUNK_PAGES && !(c->map[i + n] & RUN_USED))
+    n += c->map[i + n];
+  set_run(c, i, n, 0);
+}
 
-  ptr[0] = (KMALLOC_CANARY << 8) | l2;
-  return &ptr[1];
+/* Reserve a new chunk and back its header with pages requested with
+   'req'. Call with chunks_lock held. */
+static chunk_t *new_chunk_locked(int req) {
+  uintptr_t addr = vmspace_alloc(&kernel_vmspace, CHUNK_SIZE, 0, 0);
+  if (addr == (uintptr_t)~0ULL)
+    return NULL;
+  if (vmspace_map(&kernel_vmspace, addr, 1U << CHUNK_PAGE_SHIFT, PAGE_WRITE,
+                  req & ~PAGE_REQ_ZERO) == -1) {
+    vmspace_free(&kernel_vmspace, CHUNK_SIZE, addr, 0);
+    return NULL;
+  }
+
+  chunk_t *c = (chunk_t*)addr;
+  c->magic = CHUNK_MAGIC;
+  c->npages = 0;
+  c->nfree = CHUNK_PAGES - 1;
+  set_run(c, 0, 1, RUN_USED);
+  set_run(c, 1, CHUNK_PAGES - 1, 0);
+
+  c->next = chunks;
+  chunks = c;
+  return c;
 }
 
-void kfree(void *p) {
-  p = (void*) ((uintptr_t)p - sizeof(uintptr_t));
-  uintptr_t *ptr = (uintptr_t*)p;
+/* Allocate 'n' pages in a region of their own. vmspace regions are
+   naturally aligned powers of two, so the header is at a chunk boundary,
+   but only the pages asked for are backed. */
+static void *huge_alloc(unsigned n, int req) {
+  unsigned sz = (n + 1) << CHUNK_PAGE_SHIFT;
+  unsigned reserved = 1U << log2_roundup(sz);
+  uintptr_t addr = vmspace_alloc(&kernel_vmspace, reserved, 0, 0);
+  if (addr == (uintptr_t)~0ULL)
+    return NULL;
+  if (vmspace_map(&kernel_vmspace, addr, sz, PAGE_WRITE, req) == -1) {
+    vmspace_free(&kernel_vmspace, reserved, addr, 0);
+    return NULL;
+  }
+
+  chunk_t *c = (chunk_t*)addr;
+  c->magic = CHUNK_MAGIC;
+  c->npages = n;
+  c->reserved = reserved;
+  c->req = req & PAGE_REQ_ZONE_MASK;
+  return (void*)PAGE_ADDR(c, 1);
+}
+
+/* The PMM request to back an allocation made with 'flags'. */
+static int page_req(unsigned flags) {
+  int req = (flags & KM_UNDER4GB) ? PAGE_REQ_UNDER4GB : PAGE_REQ_NONE;
+  if (flags & KM_ZERO)
+    req |= PAGE_REQ_ZERO;
+  if (flags & KM_NOFAIL)
+    req |= PAGE_REQ_RESERVE;
+  return req;
+}
+
+/* Allocate 'sz' bytes of whole pages, aligned to 'align' bytes. Alignments
+   above a page are only honoured within a chunk. Always fails with
+   KM_ATOMIC: backing the pages takes the vmspace and PMM locks, which
+   can't be waited for. */
+static void *large_alloc(unsigned sz, unsigned align, unsigned flags) {
+  if (flags & KM_ATOMIC)
+    return NULL;
+
+  unsigned n = NPAGES(sz);
+  unsigned a = (align >> CHUNK_PAGE_SHIFT) ? (align >> CHUNK_PAGE_SHIFT) : 1;
+  int req = page_req(flags);
+  if (n >= CHUNK_PAGES)
+    return (a == 1) ? huge_alloc(n, req) : NULL;
+  /* Page 0 is the header, so an aligned run starts at page 'a' at the
+     earliest. Don't make a chunk that can't hold it. */
+  if (a + n > CHUNK_PAGES)
+    return NULL;
+
+  spinlock_acquire(&chunks_lock);
+
+  chunk_t *c;
+  unsigned i = 0, j;
+  for (c = chunks; c; c = c->next)
+    if (c->nfree >= n && (i = find_run(c, n, a, &j)) != 0)
+      break;
+  if (!c && (c = new_chunk_locked(req)) != NULL)
+    i = find_run(c, n, a, &j);
+  if (!c || !i) {
+    spinlock_release(&chunks_lock);
+    return NULL;
+  }
+
+  /* Split off whatever the fit leaves either side of it. */
+  unsigned len = c->map[i];
+  if (j > i)
+    set_run(c, i, j - i, 0);
+  set_run(c, j, n, (flags & KM_UNDER4GB) ? RUN_USED|RUN_LOW : RUN_USED);
+  if (i + len > j + n)
+    set_run(c, j + n, i + len - (j + n), 0);
+  c->nfree -= n;
+
+  spinlock_release(&chunks_lock);
+
+  /* The run is ours now, so it can be backed without the lock. */
+  if (vmspace_map(&kernel_vmspace, PAGE_ADDR(c, j), n << CHUNK_PAGE_SHIFT,
+                  PAGE_WRITE, req) == -1) {
+    spinlock_acquire(&chunks_lock);
+    free_run_locked(c, j, n);
+    spinlock_release(&chunks_lock);
+    return NULL;
+  }
+  return (void*)PAGE_ADDR(c, j);
+}
+
+/* Return the chunk 'p' is in, and the index of its first page. */
+static chunk_t *large_lookup(void *p, unsigned *idx) {
+  chunk_t *c = CHUNK_FOR_PTR(p);
+  assert(c->magic == CHUNK_MAGIC && "Heap corruption!");
+
+  unsigned i = ((uintptr_t)p - (uintptr_t)c) >> CHUNK_PAGE_SHIFT;
+  assert(PAGE_ADDR(c, i) == (uintptr_t)p && i > 0 &&
+         (c->npages || (c->map[i] & RUN_USED)) && "Heap corruption!");
+  *idx = i;
+  return c;
+}
+
+/* Usable size of the large allocation at 'p'. */
+static unsigned large_size(void *p) {
+  unsigned i;
+  chunk_t *c = large_lookup(p, &i);
+  unsigned n = c->npages ? c->npages : (c->map[i] & ~RUN_FLAGS);
+  return n << CHUNK_PAGE_SHIFT;
+}
+
+/* The KM_* flags to allocate like the large allocation at 'p' with. */
+static unsigned large_flags(void *p) {
+  unsigned i;
+  chunk_t *c = large_lookup(p, &i);
+  int low = c->npages ? (c->req == PAGE_REQ_UNDER4GB) : (c->map[i] & RUN_LOW);
+  return low ? KM_UNDER4GB : 0;
+}
+
+/* Try to resize the large allocation at 'p' to 'sz' bytes without moving
+   it, backing any new pages from the same zone as the rest. Returns -1 if
+   there isn't room after it. */
+static int large_resize(void *p, unsigned sz) {
+  unsigned i, n = NPAGES(sz);
+  chunk_t *c = large_lookup(p, &i);
+
+  if (c->npages) {
+    unsigned have = c->npages;
+    if (n + 1 > c->reserved >> CHUNK_PAGE_SHIFT)
+      return -1;
+    if (n > have &&
+        vmspace_map(&kernel_vmspace, PAGE_ADDR(c, have + 1),
+                    (n - have) << CHUNK_PAGE_SHIFT, PAGE_WRITE,
+                    c->req) == -1)
+      return -1;
+    if (n < have)
+      vmspace_unmap(&kernel_vmspace, PAGE_ADDR(c, n + 1),
+                    (have - n) << CHUNK_PAGE_SHIFT);
+    c->npages = n;
+    return 0;
+  }
+
+  if (n >= CHUNK_PAGES)
+    return -1;
+
+  unsigned have = c->map[i] & ~RUN_FLAGS;
+  unsigned used = c->map[i] & RUN_FLAGS;
+  if (n < have) {
+    vmspace_unmap(&kernel_vmspace, PAGE_ADDR(c, i + n),
+                  (have - n) << CHUNK_PAGE_SHIFT);
+    spinlock_acquire(&chunks_lock);
+    set_run(c, i, n, used);
+    free_run_locked(c, i + n, have - n);
+    spinlock_release(&chunks_lock);
+    return 0;
+  }
+
+  if (n > have) {
+    spinlock_acquire(&chunks_lock);
+    unsigned j = i + have, more = n - have;
+    if (j >= CHUNK_PAGES || (c->map[j] & RUN_USED) || c->map[j] < more) {
+      spinlock_release(&chunks_lock);
+      return -1;
+    }
+    unsigned len = c->map[j];
+    set_run(c, i, n, used);
+    if (len > more)
+      set_run(c, i + n, len - more, 0);
+    c->nfree -= more;
+    spinlock_release(&chunks_lock);
+
+    int req = (used & RUN_LOW) ? PAGE_REQ_UNDER4GB : PAGE_REQ_NONE;
+    if (vmspace_map(&kernel_vmspace, PAGE_ADDR(c, j),
+                    more << CHUNK_PAGE_SHIFT, PAGE_WRITE, req) == -1) {
+      spinlock_acquire(&chunks_lock);
+      set_run(c, i, have, used);
+      free_run_locked(c, j, more);
+      spinlock_release(&chunks_lock);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void large_free(void *p) {
+  unsigned i;
+  chunk_t *c = large_lookup(p, &i);
+
+  if (c->npages) {
+    vmspace_unmap(&kernel_vmspace, (uintptr_t)c,
+                  (c->npages + 1) << CHUNK_PAGE_SHIFT);
+    vmspace_free(&kernel_vmspace, c->reserved, (uintptr_t)c, 0);
+    return;
+  }
+
+  unsigned n = c->map[i] & ~RUN_FLAGS;
+  vmspace_unmap(&kernel_vmspace, (uintptr_t)p, n << CHUNK_PAGE_SHIFT);
+
+  spinlock_acquire(&chunks_lock);
+
+  free_run_locked(c, i, n);
+
+  /* Give back empty chunks, but keep one around. */
+  if (c->nfree == CHUNK_PAGES - 1 && (chunks != c || c->next)) {
+    chunk_t **pc = &chunks;
+    while (*pc != c)
+      pc = &(*pc)->next;
+    *pc = c->next;
+    spinlock_release(&chunks_lock);
+
+    vmspace_unmap(&kernel_vmspace, (uintptr_t)c, 1U << CHUNK_PAGE_SHIFT);
+    vmspace_free(&kernel_vmspace, CHUNK_SIZE, (uintptr_t)c, 0);
+    return;
+  }
+
+  spinlock_release(&chunks_lock);
+}
+
+/* Find the site for the call stack 'pcs', adding it if need be. Call with
+   kprof_lock held. */
+static kprof_site_t *kprof_site_locked(uintptr_t *pcs) {
+  for (unsigned i = 0; i < KPROF_SITES - 1; ++i) {
+    kprof_site_t *s = &kprof_sites[i];
+    if (s->nsamples == 0) {
+      memcpy(s->pcs, pcs, sizeof(s->pcs));
+      return s;
+    }
+    unsigned j = 0;
+    while (j < KPROF_DEPTH && s->pcs[j] == pcs[j])
+      ++j;
+    if (j == KPROF_DEPTH)
+      return s;
+  }
+  return &kprof_sites[KPROF_SITES - 1];
+}
+
+/* Sample the allocation of 'sz' bytes at 'p'. The frames to skip are this
+   one and the allocator entry point's: this is never inlined, and
+   everything between it and the entry points is always inlined
+   (INLINE_ENTRY below), whatever the optimisation level. */
+static __attribute__((noinline)) void kprof_sample(void *p, unsigned sz) {
+  /* Restart the countdown somewhere in [rate/2, rate*3/2), so periodic
+     allocation patterns don't alias with the sampling. */
+  kprof_seed = kprof_seed * 1103515245 + 12345;
+  kprof_countdown = kprof_rate / 2 + (kprof_seed >> 8) % (kprof_rate | 1);
+
+  uintptr_t pcs[KPROF_DEPTH] = {0};
+  get_stack_trace(pcs, KPROF_DEPTH, 2);
+
+  /* Small allocations are sampled with probability about sz/rate, so each
+     stands for 'rate' bytes. */
+  unsigned weight = (sz > kprof_rate) ? sz : kprof_rate;
+
+  spinlock_acquire(&kprof_lock);
+  /* Keep a slot free, so lookups always find an empty one. */
+  if (kprof_nsamples < KPROF_SAMPLES - 1) {
+    unsigned i = KPROF_HASH(p);
+    while (kprof_samples[i].ptr)
+      i = (i + 1) & (KPROF_SAMPLES - 1);
+
+    kprof_site_t *s = kprof_site_locked(pcs);
+    s->live += weight;
+    ++s->nsamples;
+
+    kprof_samples[i].ptr = p;
+    kprof_samples[i].weight = weight;
+    kprof_samples[i].site = s;
+    ++kprof_nsamples;
+    ++kprof_marks[KPROF_MARK(p)];
+  }
+  spinlock_release(&kprof_lock);
+}
+
+/* If 'p' was sampled, take it off its site. */
+static void kprof_free(void *p) {
+  spinlock_acquire(&kprof_lock);
+
+  unsigned i = KPROF_HASH(p);
+  while (kprof_samples[i].ptr && kprof_samples[i].ptr != p)
+    i = (i + 1) & (KPROF_SAMPLES - 1);
+
+  if (kprof_samples[i].ptr) {
+    kprof_samples[i].site->live -= kprof_samples[i].weight;
+    --kprof_nsamples;
+    --kprof_marks[KPROF_MARK(p)];
+
+    /* Shift back any later entries of the probe sequence that would no
+       longer be found past the hole. */
+    unsigned j = i;
+    for (;;) {
+      j = (j + 1) & (KPROF_SAMPLES - 1);
+      if (!kprof_samples[j].ptr)
+        break;
+      unsigned k = KPROF_HASH(kprof_samples[j].ptr);
+      if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+        continue;
+      kprof_samples[i] = kprof_samples[j];
+      i = j;
+    }
+    kprof_samples[i].ptr = NULL;
+  }
+
+  spinlock_release(&kprof_lock);
+}
+
+/* For functions that sit between the public entry points and
+   kprof_sample(), which must add no stack frames of their own. */
+#define INLINE_ENTRY static inline __attribute__((always_inline))
+
+/* Count 'sz' bytes allocated at 'p' towards the next sample. */
+INLINE_ENTRY void *kprof_account(void *p, unsigned sz) {
+  if (p && kprof_rate &&
+      __sync_sub_and_fetch(&kprof_countdown, (int)sz) <= 0)
+    kprof_sample(p, sz);
+  return p;
+}
+
+void kmalloc_profile_set_rate(unsigned rate) {
+  kprof_rate = rate;
+  kprof_countdown = rate;
+}
+
+void kmalloc_profile_dump() {
+  elf_t *elf = get_kernel_elf();
+
+  spinlock_acquire(&kprof_lock);
+  printk("kmalloc profile: 1 sample per %d bytes, %d live samples\n",
+         kprof_rate, kprof_nsamples);
+  for (unsigned i = 0; i < KPROF_SITES; ++i) {
+    kprof_site_t *s = &kprof_sites[i];
+    if (s->nsamples == 0)
+      continue;
+    printk("%d bytes live (%d samples)%s\n", s->live, s->nsamples,
+           (i == KPROF_SITES - 1) ? " at other sites" : "");
+    for (unsigned j = 0; j < KPROF_DEPTH && s->pcs[j]; ++j) {
+      const char *name = elf ? elf_lookup_symbol(s->pcs[j], elf) : NULL;
+      printk("   [0x%x] %s\n", s->pcs[j], name ? name : "?");
+    }
+  }
+  spinlock_release(&kprof_lock);
+}
+
+/* The entry points below record each call in the allocation trace; these
+   do the work, so that calls between them aren't recorded twice. The
+   entry points never call each other, so that the profiler sees exactly
+   one allocator frame. */
+INLINE_ENTRY void *alloc_flags(unsigned sz, unsigned flags) {
+  assert(!((flags & KM_ATOMIC) && (flags & KM_NOFAIL)) &&
+         "KM_ATOMIC allocations can fail!");
+
+  /* Slabs may be anywhere in physical memory, so low memory means whole
+     pages. */
+  void *p;
+  if (sz <= KMALLOC_MAX_CLASS && !(flags & KM_UNDER4GB)) {
+    unsigned sflags = 0;
+    if (flags & KM_ATOMIC)
+      sflags |= SLAB_ATOMIC;
+    if (flags & KM_ZERO)
+      sflags |= SLAB_ZERO;
+    if (flags & KM_NOFAIL)
+      sflags |= SLAB_RESERVE;
+    p = slab_cache_alloc_flags(&caches[size_class(sz)], sflags);
+  } else {
+    p = large_alloc(sz, 0, flags);
+  }
 
-  unsigned l2 = ptr[0] & 0xFF;
-  unsigned canary = ptr[0] >> 8;
+  if (!p && (flags & KM_NOFAIL))
+    panic("kmalloc: out of memory allocating %d bytes!", sz);
+  /* Sampling takes a lock, which atomic allocations mustn't wait for. */
+  return (flags & KM_ATOMIC) ? p : kprof_account(p, sz);
+}
 
-  assert(canary == KMALLOC_CANARY && "Heap corruption!");
+static void free_ptr(void *p) {
+  /* 'p' can't be sampled while it is being freed, so an unset mark means
+     it isn't in the table. */
+  if (*(volatile uint8_t *)&kprof_marks[KPROF_MARK(p)])
+    kprof_free(p);
 
-  if (l2 <= MAX_CACHESZ_LOG2)
-    slab_cache_free(&caches[l2-MIN_CACHESZ_LOG2], p);
+  /* Slab memory knows which cache it came from. */
+  slab_cache_t *c = slab_cache_for(p);
+  if (c)
+    slab_cache_free(c, p);
   else
-    vmspace_free(&kernel_vmspace, (1U << l2), (uintptr_t)p, 1);
+    large_free(p);
+}
+
+INLINE_ENTRY void *resize(void *p, unsigned sz) {
+  /* Stay put if the object still fits and isn't less than half used. */
+  unsigned old, flags = 0;
+  slab_cache_t *c = slab_cache_for(p);
+  if (c) {
+    old = c->size;
+    if (sz <= old && sz > old / 2)
+      return p;
+  } else {
+    if (sz > KMALLOC_MAX_CLASS && large_resize(p, sz) == 0)
+      return p;
+    old = large_size(p);
+    /* Memory from below 4GB stays there. */
+    flags = large_flags(p);
+  }
+
+  void *q = alloc_flags(sz, flags);
+  if (!q)
+    return NULL;
+  memcpy(q, p, MIN(old, sz));
+  free_ptr(p);
+  return q;
+}
+
+INLINE_ENTRY void *alloc_traced(unsigned sz, unsigned flags) {
+  void *p = alloc_flags(sz, flags);
+  if (p)
+    alloc_trace(TRACE_KMALLOC, sz, (uintptr_t)p, flags);
+  return p;
+}
+
+void *kmalloc(unsigned sz) {
+  return alloc_traced(sz, 0);
+}
+
+void *kmalloc_flags(unsigned sz, unsigned flags) {
+  return alloc_traced(sz, flags);
+}
+
+void kfree(void *p) {
+  if (!p)
+    return;
+
+  alloc_trace(TRACE_KFREE, 0, (uintptr_t)p, 0);
+  free_ptr(p);
+}
+
+void *kmalloc_aligned(unsigned sz, unsigned align) {
+  assert(align && !(align & (align - 1)) &&
+         "Alignment must be a power of two!");
+
+  void *p;
+
+  /* Slab objects sit at multiples of their size from a colour offset
+     that is itself a multiple of SLAB_COLOUR_ALIGN, so any class whose
+     size is a multiple of 'align' will do. */
+  if (sz <= KMALLOC_MAX_CLASS && align <= SLAB_COLOUR_ALIGN) {
+    unsigned cls = size_class(sz);
+    while (class_sizes[cls] & (align - 1))
+      ++cls;
+    p = slab_cache_alloc(&caches[cls]);
+  } else {
+    p = large_alloc(sz, align, 0);
+  }
+
+  if (p)
+    alloc_trace(TRACE_KALIGNED, sz, (uintptr_t)p, align);
+  return kprof_account(p, sz);
+}
+
+void *kcalloc(unsigned n, unsigned sz) {
+  if (sz && n > ~0U / sz)
+    return NULL;
+
+  return alloc_traced(n * sz, KM_ZERO);
+}
+
+void *krealloc(void *p, unsigned sz) {
+  if (!p)
+    return alloc_traced(sz, 0);
+  if (sz == 0) {
+    kfree(p);
+    return NULL;
+  }
+
+  void *q = resize(p, sz);
+  if (q)
+    alloc_trace(TRACE_KREALLOC, sz, (uintptr_t)q, (uintptr_t)p);
+  return q;
 }
 
 static int kmalloc_init() {
@@ -77,9 +682,16 @@ static int kmalloc_init() {
     return -1;
   }
 
+  unsigned cls = 0;
+  for (unsigned i = 0; i < sizeof(size_to_class); ++i) {
+    while (class_sizes[cls] < (i << CLASS_GRAIN_LOG2))
+      ++cls;
+    size_to_class[i] = cls;
+  }
+
   int r = 0;
-  for (unsigned i = 0; i <= MAX_CACHESZ_LOG2-MIN_CACHESZ_LOG2; ++i) {
-    r |= slab_cache_create(&caches[i], &kernel_vmspace, 1U<<(i+MIN_CACHESZ_LOG2), NULL);
+  for (unsigned i = 0; i < NUM_CLASSES; ++i) {
+    r |= slab_cache_create(&caches[i], &kernel_vmspace, class_sizes[i], NULL, NULL);
   }
   assert(r == 0  && "slab cache creation failed!");
 
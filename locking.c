@@ -20,6 +20,20 @@ void spinlock_acquire(spinlock_t *lock) {
   lock->interrupts = interrupts;
 }
 
+int spinlock_try_acquire(spinlock_t *lock) {
+  int interrupts = get_interrupt_state();
+
+  disable_interrupts();
+  if (__sync_bool_compare_and_swap(&lock->val, 0, 1) == 0) {
+    if (interrupts)
+      enable_interrupts();
+    return 0;
+  }
+
+  lock->interrupts = interrupts;
+  return 1;
+}
+
 void spinlock_release(spinlock_t *lock) {
   while (__sync_bool_compare_and_swap(&lock->val, 1, 0) == 0)
     ;
@@ -8,10 +8,12 @@
  * Copyright (c)2013 Ross Bamford. See LICENSE for details.
  */
 #include "hal.h"
+#include "alloctrace.h"
 #include "assert.h"
 #include "sys.h"
 #include "utils.h"
 #include "mmap.h"
+#include "pmm.h"
 #include "adt/buddy.h"
 
 #if defined(KDEBUG_ENABLED) && defined(KDEBUG_PMM)
@@ -20,6 +22,10 @@
 #define dbg(args...)
 #endif
 
+/* Page events are traced by page frame number, which fits an address. */
+#define trace(op, num, page, arg) \
+  alloc_trace(op, num, (uintptr_t)((page) >> get_page_shift()), arg)
+
 #define MIN(x, y) ( (x < y) ? x : y )
 #define MAX(x, y) ( (x > y) ? x : y )
 
@@ -34,7 +40,153 @@ unsigned early_nranges;
 uint64_t early_max_extent;
 
 static spinlock_t lock = SPINLOCK_RELEASED;
-static buddy_t allocators[3];
+
+/* Physical memory is managed in fixed-size, naturally aligned sections,
+ * each with its own buddy allocator. Only sections that actually contain
+ * RAM get an allocator, and each one's bitmaps only extend as far as the
+ * highest RAM address inside it - so metadata (and the time taken to
+ * initialise it) scales with installed memory, not with the highest
+ * physical address. Holes such as the PCI hole below 4GB, or the gap
+ * before memory above 4GB, cost nothing.
+ *
+ * A section is as large as the largest buddy block, so sections never
+ * split a block that would otherwise have been available. Memory below
+ * 1MB has a section of its own. */
+#define SECTION_SHIFT MAX_BUDDY_SZ_LOG2
+#define SECTION_SIZE  (1ULL << SECTION_SHIFT)
+#define NUM_SECTIONS  64    /* Enough for a 36-bit physical address space. */
+
+typedef struct section {
+  buddy_t allocator;
+  int present;
+  struct section *next;     /* Next present section in the same zone. */
+} section_t;
+
+/* Zones.
+ *
+ * Each zone has an ordered list of the zones an allocation from it may be
+ * satisfied from, and three watermarks (in pages):
+ *
+ *  - Below 'min' lies an emergency reserve that only PAGE_REQ_RESERVE
+ *    allocations (page tables, allocations that cannot sleep or fail) may
+ *    dip into.
+ *  - An allocation that has fallen back from a higher zone must leave at
+ *    least 'low' pages free, so general allocations can't starve the
+ *    scarcer low zones.
+ *  - Opportunistic work, such as refilling the zero pool, is only done
+ *    while a zone is above 'high'.
+ *
+ * The watermarks are computed from the zone's size at init time and can
+ * be overridden with pmm_set_zone_watermarks(). */
+#define WMARK_MIN  0
+#define WMARK_LOW  1
+#define WMARK_HIGH 2
+
+typedef struct zone {
+  section_t *sections;      /* Present sections, lowest address first. */
+  const int *fallback;      /* Zones to try, in order, terminated by -1. */
+  unsigned wmark[3];        /* Indexed by WMARK_*. */
+  unsigned nfailures;       /* Allocations no zone could satisfy. */
+} zone_t;
+
+/* Internal flag for alloc_pages_locked(): respect the high watermark. */
+#define ALLOC_WMARK_HIGH 0x10000
+
+static const int fallback_none[]     = {PAGE_REQ_NONE, PAGE_REQ_UNDER4GB, -1};
+static const int fallback_under1mb[] = {PAGE_REQ_UNDER1MB, -1};
+static const int fallback_under4gb[] = {PAGE_REQ_UNDER4GB, -1};
+
+static section_t sections[NUM_SECTIONS];
+static section_t low_section;
+static zone_t zones[3] = {
+  [PAGE_REQ_NONE]     = { .fallback = fallback_none },
+  [PAGE_REQ_UNDER1MB] = { .fallback = fallback_under1mb },
+  [PAGE_REQ_UNDER4GB] = { .fallback = fallback_under4gb },
+};
+
+/* Contiguous memory region.
+ *
+ * A naturally aligned region below 4GB is set aside at boot for large,
+ * physically contiguous allocations (alloc_pages_aligned()) that the
+ * general zones are too fragmented to satisfy. It has a buddy allocator of
+ * its own, so alloc_page() and friends never hand its pages out - which
+ * also means it is memory the rest of the kernel can't use, so keep it
+ * small. Build with -DCMA_SIZE=0 to do without. */
+#ifndef CMA_SIZE
+#define CMA_SIZE 0x200000ULL    /* 2MB. A power of two, or 0. */
+#endif
+
+static struct {
+  buddy_t allocator;
+  uint64_t start, size;     /* 'size' is zero if there is no region. */
+} cma;
+
+static int in_cma(uint64_t page) {
+  return page >= cma.start && page < cma.start + cma.size;
+}
+
+static int zone_for(uint64_t page) {
+  if (page < 0x100000)
+    return PAGE_REQ_UNDER1MB;
+  else if (page < 0x100000000ULL)
+    return PAGE_REQ_UNDER4GB;
+  return PAGE_REQ_NONE;
+}
+
+/* Return the buddy allocator responsible for 'page'. */
+static buddy_t *buddy_for(uint64_t page) {
+  if (in_cma(page))
+    return &cma.allocator;
+  if (page < 0x100000)
+    return &low_section.allocator;
+
+  section_t *s = &sections[page >> SECTION_SHIFT];
+  assert(s->present && "Page is not in a present section!");
+  return &s->allocator;
+}
+
+/* Return 'num' pages at 'page' to the buddy allocator they came from.
+   Must be called with the global lock held. */
+static void free_to_buddy_locked(uint64_t page, size_t num) {
+  buddy_free(buddy_for(page), page, num * get_page_size());
+}
+
+/* Allocate 'num' contiguous pages, aligned to 2^align_log2 bytes, from any
+   section in zone 'req', or return ~0ULL. Must be called with the global
+   lock held. */
+static uint64_t zone_alloc_locked(int req, size_t num, unsigned align_log2) {
+  for (section_t *s = zones[req].sections; s; s = s->next) {
+    if (s->allocator.free < num)
+      continue;
+    uint64_t val = buddy_alloc_aligned(&s->allocator, num * get_page_size(),
+                                       align_log2);
+    if (val != ~0ULL)
+      return val;
+  }
+  return ~0ULL;
+}
+
+/* Return the number of pages free in the buddy allocators of zone 'req'. */
+static uint32_t zone_free_count(int req) {
+  uint32_t n = 0;
+  for (section_t *s = zones[req].sections; s; s = s->next)
+    n += s->allocator.free;
+  return n;
+}
+
+/* Set default watermarks for zone 'req' from its size: 'min' is 1/128th
+   of the zone (at least 8 pages, but never more than a quarter of it), and
+   'low' and 'high' are 25% and 50% above that. */
+static void init_watermarks(int req) {
+  uint32_t total = 0;
+  for (section_t *s = zones[req].sections; s; s = s->next)
+    total += s->allocator.total;
+
+  unsigned min = MIN(MAX(total >> 7, 8U), total >> 2);
+  zones[req].wmark[WMARK_MIN]  = min;
+  zones[req].wmark[WMARK_LOW]  = min + (min >> 2);
+  zones[req].wmark[WMARK_HIGH] = min + (min >> 1);
+}
 
 static range_t split_range(range_t *r, uint64_t loc) {
   range_t ret;
@@ -55,42 +207,520 @@ static range_t split_range(range_t *r, uint64_t loc) {
   return ret;
 }
 
+/* Per-CPU page caches.
+ *
+ * Single page allocations and frees go through a small per-CPU, per-zone
+ * cache of page frames rather than straight to the buddy allocators, much
+ * like Linux's per-cpu pagesets. The cache is only ever touched by its own
+ * CPU with interrupts disabled, so the common case doesn't need the global
+ * lock at all - we only take it to move a batch of pages in or out.
+ *
+ * Each cache is a ring of page frame numbers with a "hot" end and a "cold"
+ * end. Frees push onto, and allocations pop from, the hot end, so a page
+ * that was just freed (and is likely still in the CPU cache) is the next to
+ * be handed out. When a cache grows past its high watermark, pages are
+ * drained back to the buddy allocator from the cold end. */
+#define PCP_MAX_CPUS  16   /* CPUs above this go straight to the allocator. */
+#define PCP_MAX_HIGH  128  /* Capacity of each cache, in pages. */
+
+typedef struct page_cache {
+  uint32_t pfns[PCP_MAX_HIGH];
+  unsigned cold;    /* Index of the coldest entry. */
+  unsigned count;
+} page_cache_t;
+
+static page_cache_t page_caches[PCP_MAX_CPUS][3];
+static unsigned pcp_batch = 16;
+static unsigned pcp_high  = 64;
+
+static page_cache_t *get_page_cache(int req) {
+  int cpu = get_current_cpucore();
+  return (cpu < PCP_MAX_CPUS) ? &page_caches[cpu][req] : NULL;
+}
+
+static void pcp_push_hot(page_cache_t *pc, uint64_t page) {
+  pc->pfns[(pc->cold + pc->count++) % PCP_MAX_HIGH] = page >> get_page_shift();
+}
+
+static uint64_t pcp_pop_hot(page_cache_t *pc) {
+  uint64_t pfn = pc->pfns[(pc->cold + --pc->count) % PCP_MAX_HIGH];
+  return pfn << get_page_shift();
+}
+
+static uint64_t pcp_pop_cold(page_cache_t *pc) {
+  uint64_t pfn = pc->pfns[pc->cold];
+  pc->cold = (pc->cold + 1) % PCP_MAX_HIGH;
+  --pc->count;
+  return pfn << get_page_shift();
+}
+
+/* Return up to 'n' of the coldest pages in 'pc' to the allocators. A cache
+   may hold pages from a lower zone (PAGE_REQ_NONE falls back to
+   PAGE_REQ_UNDER4GB), so each page goes back to the zone it came from.
+   Must be called with the global lock held. */
+static void pcp_drain_locked(page_cache_t *pc, unsigned n) {
+  while (n-- && pc->count) {
+    uint64_t page = pcp_pop_cold(pc);
+    free_to_buddy_locked(page, 1);
+  }
+}
+
+/* Pool of pre-zeroed pages.
+ *
+ * Page tables, fresh slabs and the like all need zeroed pages. Rather than
+ * zeroing them on the allocation path, the idle loop takes free pages,
+ * zeroes them and parks them here for PAGE_REQ_ZERO allocations. The pool
+ * is protected by the global lock. Pages in it still count as free, and
+ * are given back to the buddy allocators when memory is tight. */
+#define ZERO_POOL_SIZE 64   /* Pages */
+
+static struct {
+  uint32_t pfns[ZERO_POOL_SIZE];
+  unsigned count;
+  unsigned nzone[3];        /* Number of pages in the pool from each zone. */
+} zero_pool;
+
+/* Return every cached page on this CPU, and everything in the zero pool,
+   to the allocators. Called when memory is low. Must be called with the
+   global lock held and interrupts disabled. */
+static void drain_all_locked() {
+  int cpu = get_current_cpucore();
+  if (cpu < PCP_MAX_CPUS) {
+    for (int req = 0; req < 3; ++req)
+      pcp_drain_locked(&page_caches[cpu][req], PCP_MAX_HIGH);
+  }
+
+  while (zero_pool.count > 0) {
+    uint64_t page = (uint64_t)zero_pool.pfns[--zero_pool.count] << get_page_shift();
+    --zero_pool.nzone[zone_for(page)];
+    free_to_buddy_locked(page, 1);
+  }
+}
+
+/* Return a page from the zero pool that satisfies zone 'req', or ~0ULL.
+   Must be called with the global lock held. */
+static uint64_t zero_pool_take_locked(int req) {
+  if (zero_pool.count == 0)
+    return ~0ULL;
+
+  uint64_t page = (uint64_t)zero_pool.pfns[zero_pool.count - 1] << get_page_shift();
+  int zone = zone_for(page);
+  if (req != PAGE_REQ_NONE && zone != req &&
+      !(req == PAGE_REQ_UNDER4GB && zone == PAGE_REQ_UNDER1MB))
+    return ~0ULL;
+
+  --zero_pool.count;
+  --zero_pool.nzone[zone];
+  return page;
+}
+
+/* Allocate from the buddy allocators, walking the zone's fallback list
+   and honouring each zone's watermarks. 'req' may include
+   PAGE_REQ_RESERVE or ALLOC_WMARK_HIGH. Must be called
+   with the global lock held. */
+static uint64_t alloc_aligned_locked(int req, size_t num,
+                                     unsigned align_log2) {
+  int zone = req & PAGE_REQ_ZONE_MASK;
+
+  for (const int *z = zones[zone].fallback; *z != -1; ++z) {
+    unsigned mark;
+    if (req & PAGE_REQ_RESERVE)
+      mark = 0;
+    else if (req & ALLOC_WMARK_HIGH)
+      mark = zones[*z].wmark[WMARK_HIGH];
+    else
+      mark = zones[*z].wmark[(*z == zone) ? WMARK_MIN : WMARK_LOW];
+
+    if (zone_free_count(*z) < num + mark)
+      continue;
+
+    uint64_t val = zone_alloc_locked(*z, num, align_log2);
+    if (val != ~0ULL)
+      return val;
+  }
+
+  if (!(req & ALLOC_WMARK_HIGH))
+    ++zones[zone].nfailures;
+  return ~0ULL;
+}
+
+static uint64_t alloc_pages_locked(int req, size_t num) {
+  return alloc_aligned_locked(req, num, 0);
+}
+
 uint64_t alloc_page(int req) {
-  return alloc_pages(req, 1);
+  int zero = req & PAGE_REQ_ZERO;
+  int zone = req & PAGE_REQ_ZONE_MASK;
+
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+
+  uint64_t val = ~0ULL;
+
+  if (zero) {
+    spinlock_acquire(&lock);
+    val = zero_pool_take_locked(zone);
+    spinlock_release(&lock);
+
+    if (val != ~0ULL) {
+      if (interrupts)
+        enable_interrupts();
+      trace(TRACE_PAGES, 1, val, req);
+      return val;
+    }
+  }
+
+  page_cache_t *pc = get_page_cache(zone);
+
+  if (pc && pc->count == 0) {
+    /* Refill a batch at a time, under a single lock hold. Batches never
+       come out of the reserve - if this falls short, a PAGE_REQ_RESERVE
+       allocation gets its single page from alloc_pages() below. */
+    spinlock_acquire(&lock);
+    while (pc->count < pcp_batch) {
+      uint64_t p = alloc_pages_locked(zone, 1);
+      if (p == ~0ULL)
+        break;
+      pcp_push_hot(pc, p);
+    }
+    spinlock_release(&lock);
+  }
+
+  /* alloc_pages() traces the slow path itself. */
+  if (pc && pc->count > 0) {
+    val = pcp_pop_hot(pc);
+    trace(TRACE_PAGES, 1, val, req);
+  } else {
+    val = alloc_pages(req & ~PAGE_REQ_ZERO, 1);
+  }
+
+  if (interrupts)
+    enable_interrupts();
+
+  if (zero && val != ~0ULL)
+    zero_physical_page(val);
+  return val;
 }
 
 uint64_t alloc_pages(int req, size_t num) {
+  int zero = req & PAGE_REQ_ZERO;
+  req &= PAGE_REQ_ZONE_MASK | PAGE_REQ_RESERVE;
+
   dbg("alloc_pages: get lock\n");
   spinlock_acquire(&lock);
   dbg("alloc_pages: got lock\n");
-  uint64_t val = buddy_alloc(&allocators[req], num * get_page_size());
+  uint64_t val = alloc_pages_locked(req, num);
+
+  if (val == ~0ULL) {
+    /* Memory is tight - give back anything sitting in the page caches
+       and try again, in case that lets the buddy allocator coalesce. */
+    drain_all_locked();
+    val = alloc_pages_locked(req, num);
+  }
+
+  spinlock_release(&lock);
+
+  if (val == ~0ULL)
+    return val;
+  trace(TRACE_PAGES, num, val, req);
+
+  if (zero) {
+    for (size_t i = 0; i < num; ++i)
+      zero_physical_page(val + i * get_page_size());
+  }
+  return val;
+}
+
+uint64_t alloc_pages_aligned(int req, size_t num, unsigned align_log2) {
+  int zero = req & PAGE_REQ_ZERO;
+  int zone = req & PAGE_REQ_ZONE_MASK;
+  req &= PAGE_REQ_ZONE_MASK | PAGE_REQ_RESERVE;
+
+  if (align_log2 < get_page_shift())
+    align_log2 = get_page_shift();
+  if (num == 0 || align_log2 > MAX_BUDDY_SZ_LOG2 ||
+      num > (1U << (MAX_BUDDY_SZ_LOG2 - get_page_shift())))
+    return ~0ULL;
 
-  if (val == ~0ULL && req == PAGE_REQ_NONE)
-    val = buddy_alloc(&allocators[PAGE_REQ_UNDER4GB], num * get_page_size());
+  spinlock_acquire(&lock);
+  uint64_t val = alloc_aligned_locked(req, num, align_log2);
+
+  if (val == ~0ULL) {
+    drain_all_locked();
+    val = alloc_aligned_locked(req, num, align_log2);
+  }
+
+  /* The contiguous memory region lies below 4GB, above 1MB. */
+  if (val == ~0ULL && cma.size > 0 && zone != PAGE_REQ_UNDER1MB)
+    val = buddy_alloc_aligned(&cma.allocator, num * get_page_size(),
+                              align_log2);
 
   spinlock_release(&lock);
+
+  if (val == ~0ULL)
+    return val;
+  trace(TRACE_PAGES, num, val, req);
+
+  if (zero) {
+    for (size_t i = 0; i < num; ++i)
+      zero_physical_page(val + i * get_page_size());
+  }
   return val;
 }
 
 int free_page(uint64_t page) {
-  return free_pages(page, 1);
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+
+  int zone = zone_for(page);
+  page_cache_t *pc = get_page_cache(zone);
+
+  /* If the zone is short of memory, don't hide the page in a cache where
+     other CPUs (and the reserve) can't get at it. Pages from the contiguous
+     memory region must go straight back to it. */
+  if (pc && !in_cma(page) &&
+      zone_free_count(zone) >= zones[zone].wmark[WMARK_LOW]) {
+    if (pc->count >= pcp_high) {
+      spinlock_acquire(&lock);
+      pcp_drain_locked(pc, pcp_batch);
+      spinlock_release(&lock);
+    }
+    pcp_push_hot(pc, page);
+    trace(TRACE_FREEPAGES, 1, page, 0);
+  } else {
+    free_pages(page, 1);
+  }
+
+  if (interrupts)
+    enable_interrupts();
+  return 0;
 }
 
 int free_pages(uint64_t pages, size_t num) {
+  trace(TRACE_FREEPAGES, num, pages, 0);
   spinlock_acquire(&lock);
 
-  int req = PAGE_REQ_NONE;
-  if (pages < 0x100000)
-    req = PAGE_REQ_UNDER1MB;
-  else if (pages < 0x100000000ULL)
-    req = PAGE_REQ_UNDER4GB;
-  
-  buddy_free(&allocators[req], pages, num * get_page_size());
+  free_to_buddy_locked(pages, num);
+
+  spinlock_release(&lock);
+  return 0;
+}
+
+int alloc_pages_bulk(int req, size_t num, uint64_t *pages) {
+  int zero = req & PAGE_REQ_ZERO;
+  int zone = req & PAGE_REQ_ZONE_MASK;
+  req &= PAGE_REQ_ZONE_MASK | PAGE_REQ_RESERVE;
+
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+
+  size_t n = 0, nzeroed = 0;
+  spinlock_acquire(&lock);
+
+  /* Pages that are already zeroed go at the front of the array. */
+  while (zero && n < num) {
+    uint64_t p = zero_pool_take_locked(zone);
+    if (p == ~0ULL)
+      break;
+    pages[n++] = p;
+  }
+  nzeroed = n;
+
+  /* Then hand out anything in this CPU's cache - those pages are hot. */
+  page_cache_t *pc = get_page_cache(zone);
+  while (pc && pc->count > 0 && n < num)
+    pages[n++] = pcp_pop_hot(pc);
+
+  int drained = 0;
+  while (n < num) {
+    uint64_t p = alloc_pages_locked(req, 1);
+    if (p == ~0ULL) {
+      if (drained)
+        break;
+      drain_all_locked();
+      drained = 1;
+      continue;
+    }
+    pages[n++] = p;
+  }
+
+  if (n < num) {
+    /* Couldn't satisfy the whole request - give back what we got. */
+    for (size_t i = 0; i < n; ++i)
+      free_to_buddy_locked(pages[i], 1);
+  }
+  spinlock_release(&lock);
+
+  if (interrupts)
+    enable_interrupts();
+
+  if (n < num)
+    return -1;
+
+  for (size_t i = 0; i < num; ++i)
+    trace(TRACE_PAGES, 1, pages[i], req);
+  for (size_t i = nzeroed; zero && i < num; ++i)
+    zero_physical_page(pages[i]);
+  return 0;
+}
+
+int free_pages_bulk(uint64_t *pages, size_t num) {
+  for (size_t i = 0; i < num; ++i)
+    trace(TRACE_FREEPAGES, 1, pages[i], 0);
+  spinlock_acquire(&lock);
+
+  for (size_t i = 0; i < num; ++i)
+    free_to_buddy_locked(pages[i], 1);
+
+  spinlock_release(&lock);
+  return 0;
+}
+
+int refill_zero_pool() {
+  if (pmm_init_stage != PMM_INIT_FULL || zero_pool.count >= ZERO_POOL_SIZE)
+    return 0;
+
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+
+  /* Prefer the coldest page in this CPU's cache - it's the least likely
+     to be wanted hot, and taking it doesn't need the lock. */
+  uint64_t page = ~0ULL;
+  page_cache_t *pc = get_page_cache(PAGE_REQ_NONE);
+  if (pc && pc->count > 0) {
+    page = pcp_pop_cold(pc);
+  } else {
+    /* Only take pages from a zone that has plenty to spare. */
+    spinlock_acquire(&lock);
+    page = alloc_pages_locked(PAGE_REQ_NONE | ALLOC_WMARK_HIGH, 1);
+    spinlock_release(&lock);
+  }
+
+  if (page != ~0ULL) {
+    zero_physical_page(page);
+
+    spinlock_acquire(&lock);
+    if (zero_pool.count < ZERO_POOL_SIZE) {
+      zero_pool.pfns[zero_pool.count++] = page >> get_page_shift();
+      ++zero_pool.nzone[zone_for(page)];
+    } else {
+      free_to_buddy_locked(page, 1);
+    }
+    spinlock_release(&lock);
+  }
+
+  if (interrupts)
+    enable_interrupts();
+  return page != ~0ULL;
+}
+
+int set_page_cache_params(unsigned batch, unsigned high) {
+  if (batch == 0 || batch > high || high > PCP_MAX_HIGH)
+    return -1;
+
+  spinlock_acquire(&lock);
+  pcp_batch = batch;
+  pcp_high = high;
+  spinlock_release(&lock);
+  return 0;
+}
+
+static const char *zone_names[3] = {
+  [PAGE_REQ_NONE]     = "4GB+",
+  [PAGE_REQ_UNDER1MB] = "<1MB",
+  [PAGE_REQ_UNDER4GB] = "<4GB",
+};
+
+/* Return the number of pages of zone 'req' sitting in per-CPU caches. */
+static uint32_t cached_count(int req) {
+  uint32_t n = 0;
+  for (int cpu = 0; cpu < get_num_cpucores() && cpu < PCP_MAX_CPUS; ++cpu)
+    n += page_caches[cpu][req].count;
+  return n;
+}
+
+uint32_t pmm_get_page_count() {
+  uint32_t n = cma.allocator.total;
+  for (int req = 0; req < 3; ++req)
+    for (section_t *s = zones[req].sections; s; s = s->next)
+      n += s->allocator.total;
+  return n;
+}
+
+uint32_t pmm_get_free_count() {
+  uint32_t n = cma.allocator.free;
+  for (int req = 0; req < 3; ++req)
+    n += zone_free_count(req) + cached_count(req) + zero_pool.nzone[req];
+  return n;
+}
+
+int pmm_get_zone_stats(int req, pmm_zone_stats_t *stats) {
+  if (req < 0 || req >= 3)
+    return -1;
+
+  memset(stats, 0, sizeof(pmm_zone_stats_t));
+  for (section_t *s = zones[req].sections; s; s = s->next) {
+    stats->total   += s->allocator.total;
+    stats->free    += s->allocator.free;
+    stats->nallocs += s->allocator.nallocs;
+    stats->nfrees  += s->allocator.nfrees;
+  }
+  stats->cached    = cached_count(req);
+  stats->zeroed    = zero_pool.nzone[req];
+  stats->nfailures = zones[req].nfailures;
+  stats->wmark_min  = zones[req].wmark[WMARK_MIN];
+  stats->wmark_low  = zones[req].wmark[WMARK_LOW];
+  stats->wmark_high = zones[req].wmark[WMARK_HIGH];
+  return 0;
+}
+
+int pmm_set_zone_watermarks(int req, unsigned min, unsigned low,
+                            unsigned high) {
+  if (req < 0 || req >= 3 || min > low || low > high)
+    return -1;
 
+  spinlock_acquire(&lock);
+  zones[req].wmark[WMARK_MIN]  = min;
+  zones[req].wmark[WMARK_LOW]  = low;
+  zones[req].wmark[WMARK_HIGH] = high;
   spinlock_release(&lock);
   return 0;
 }
 
+void pmm_dump_stats() {
+  static const int order[3] = {
+    PAGE_REQ_UNDER1MB, PAGE_REQ_UNDER4GB, PAGE_REQ_NONE
+  };
+
+  printk("pmm: zone    total    free  cached  zeroed  allocs   frees   fails"
+         "     min     low    high\n");
+  for (int i = 0; i < 3; ++i) {
+    pmm_zone_stats_t st;
+    pmm_get_zone_stats(order[i], &st);
+    printk("pmm: %s %8u %7u %7u %7u %7u %7u %7u %7u %7u %7u\n",
+           zone_names[order[i]], st.total, st.free, st.cached, st.zeroed,
+           st.nallocs, st.nfrees, st.nfailures, st.wmark_min, st.wmark_low,
+           st.wmark_high);
+  }
+
+  if (cma.size > 0)
+    printk("pmm: cma %x-%x: %u of %u pages free\n",
+           (uint32_t)cma.start, (uint32_t)(cma.start + cma.size),
+           cma.allocator.free, cma.allocator.total);
+
+  printk("pmm: free blocks per order (4KB upwards):\n");
+  for (int i = 0; i < 3; ++i) {
+    printk("pmm: %s", zone_names[order[i]]);
+    for (unsigned j = 0; j < NUM_BUDDY_BUCKETS; ++j) {
+      unsigned n = 0;
+      for (section_t *s = zones[order[i]].sections; s; s = s->next)
+        n += s->allocator.nfree[j];
+      printk(" %u", n);
+    }
+    printk("\n");
+  }
+}
+
 uint64_t early_alloc_page() {
   assert(pmm_init_stage == PMM_INIT_EARLY);
   for (unsigned i = 0; i < early_nranges; ++i) {
@@ -125,6 +755,52 @@ int init_physical_memory_early(range_t *ranges, unsigned nranges,
   return 0;
 }
 
+/* Carve the contiguous memory region, CMA_SIZE bytes aligned to its size
+   (so blocks in its allocator are naturally aligned), out of
+   early_ranges. The highest suitable address is used, to leave lower
+   memory for everything else. */
+static void reserve_cma() {
+  uint64_t size = CMA_SIZE;
+  if (size == 0)
+    return;
+  assert(!(size & (size - 1)) && size >= 0x1000 &&
+         "CMA_SIZE must be a power of two!");
+
+  int best = -1;
+  uint64_t best_start = 0;
+  for (unsigned i = 0; i < early_nranges; ++i) {
+    uint64_t start = MAX(early_ranges[i].start, 0x100000ULL);
+    uint64_t end = MIN(early_ranges[i].start + early_ranges[i].extent,
+                       0x100000000ULL);
+    if (end < start + size)
+      continue;
+    uint64_t s = (end - size) & ~(size - 1);
+    if (s >= start && (best == -1 || s > best_start)) {
+      best = i;
+      best_start = s;
+    }
+  }
+  if (best == -1) {
+    dbg("no room for the contiguous memory region\n");
+    return;
+  }
+
+  /* Split the range around the region; whatever lies above it becomes a
+     new range. */
+  range_t *r = &early_ranges[best];
+  uint64_t end = r->start + r->extent;
+  if (end > best_start + size) {
+    assert(early_nranges < 64 && "Too many ranges!");
+    early_ranges[early_nranges].start = best_start + size;
+    early_ranges[early_nranges].extent = end - (best_start + size);
+    ++early_nranges;
+  }
+  r->extent = best_start - r->start;
+
+  cma.start = best_start;
+  cma.size = size;
+}
+
 int init_physical_memory() {
   if (pmm_init_stage != PMM_INIT_EARLY) {
     panic("init_physical_memory_early not called!");
@@ -133,25 +809,51 @@ int init_physical_memory() {
   assert(pmm_init_stage == PMM_INIT_EARLY &&
          "init_physical_memory_early must be called first!");
 
-  range_t rs[3];
-  rs[PAGE_REQ_UNDER1MB].start = 0x0;
-  rs[PAGE_REQ_UNDER1MB].extent = MAX(MIN(early_max_extent, 0x100000), 0);
+  reserve_cma();
+
+  /* Work out which sections contain RAM, and how far into each it goes. */
+  uint64_t low_end = 0;
+  uint64_t section_end[NUM_SECTIONS];
+  memset(section_end, 0, sizeof(section_end));
+
+  for (unsigned i = 0; i < early_nranges; ++i) {
+    uint64_t start = early_ranges[i].start;
+    uint64_t end = start + early_ranges[i].extent;
+
+    if (start < 0x100000)
+      low_end = MAX(low_end, MIN(end, 0x100000ULL));
+
+    for (uint64_t a = MAX(start, 0x100000ULL); a < end;
+         a = (a & ~(SECTION_SIZE-1)) + SECTION_SIZE) {
+      unsigned idx = a >> SECTION_SHIFT;
+      if (idx >= NUM_SECTIONS) {
+        dbg("ignoring memory beyond the last section\n");
+        break;
+      }
+      uint64_t sec_limit = (uint64_t)(idx + 1) << SECTION_SHIFT;
+      section_end[idx] = MAX(section_end[idx], MIN(end, sec_limit));
+    }
+  }
 
-  rs[PAGE_REQ_UNDER4GB].start = 0x100000;
-  rs[PAGE_REQ_UNDER4GB].extent = MAX(MIN(early_max_extent, 0x100000000ULL) -
-                                     0x100000, 0);
+  /* Size and map the bitmaps for the sections we need. */
+  range_t low_range = { .start = 0, .extent = low_end };
+  size_t bitmap_sz = buddy_calc_overhead(low_range);
 
-  rs[PAGE_REQ_NONE].start = 0x100000000ULL;
-  rs[PAGE_REQ_NONE].extent = (early_max_extent > 0x100000000ULL) ?
-    early_max_extent - 0x100000000ULL : 0;
+  for (unsigned i = 0; i < NUM_SECTIONS; ++i) {
+    if (section_end[i] == 0)
+      continue;
+    range_t r = { .start = (uint64_t)i << SECTION_SHIFT };
+    r.extent = round_to_page_size(section_end[i] - r.start);
+    bitmap_sz += buddy_calc_overhead(r);
+  }
 
-  size_t overheads[3];
-  overheads[0] = buddy_calc_overhead(rs[0]);
-  overheads[1] = buddy_calc_overhead(rs[1]);
-  overheads[2] = buddy_calc_overhead(rs[2]);
+  range_t cma_range = { .start = cma.start, .extent = cma.size };
+  if (cma.size > 0)
+    bitmap_sz += buddy_calc_overhead(cma_range);
 
-  size_t bitmap_sz = overheads[0] + overheads[1] + overheads[2];
   size_t bitmap_sz_pages = round_to_page_size(bitmap_sz) >> get_page_shift();
+  assert(bitmap_sz <= MMAP_PMM_BITMAP_END - MMAP_PMM_BITMAP &&
+         "Not enough address space for PMM bitmaps!");
 
   for (unsigned i = 0; i < bitmap_sz_pages; ++i) {
     int r = map(MMAP_PMM_BITMAP + i * get_page_size(),
@@ -159,37 +861,62 @@ int init_physical_memory() {
     assert(r == 0 && "Failed to map page");
   }
 
-  int ok;
-  ok  = buddy_init(&allocators[PAGE_REQ_UNDER1MB],
-                   (uint8_t*) MMAP_PMM_BITMAP,
-                   rs[PAGE_REQ_UNDER1MB], 0);
-  ok |= buddy_init(&allocators[PAGE_REQ_UNDER4GB],
-                   (uint8_t*) (MMAP_PMM_BITMAP + overheads[0]),
-                   rs[PAGE_REQ_UNDER4GB], 0);
-  ok |= buddy_init(&allocators[PAGE_REQ_NONE],
-                   (uint8_t*) (MMAP_PMM_BITMAP + overheads[0] + overheads[1]),
-                   rs[PAGE_REQ_NONE], 0);
+  /* Initialise an allocator for each present section, and chain each
+     onto its zone in address order. */
+  uint8_t *storage = (uint8_t*)MMAP_PMM_BITMAP;
+  int ok = buddy_init(&low_section.allocator, storage, low_range, 0);
+  storage += buddy_calc_overhead(low_range);
+  low_section.present = 1;
+  zones[PAGE_REQ_UNDER1MB].sections = &low_section;
+
+  section_t **tails[3] = {
+    &zones[PAGE_REQ_NONE].sections, NULL, &zones[PAGE_REQ_UNDER4GB].sections
+  };
+  for (unsigned i = 0; i < NUM_SECTIONS; ++i) {
+    if (section_end[i] == 0)
+      continue;
+    range_t r = { .start = (uint64_t)i << SECTION_SHIFT };
+    r.extent = round_to_page_size(section_end[i] - r.start);
+
+    ok |= buddy_init(&sections[i].allocator, storage, r, 0);
+    storage += buddy_calc_overhead(r);
+    sections[i].present = 1;
+
+    int req = zone_for(r.start + 0x100000);
+    *tails[req] = &sections[i];
+    tails[req] = &sections[i].next;
+  }
+  if (cma.size > 0) {
+    ok |= buddy_init(&cma.allocator, storage, cma_range, /*start_freed=*/1);
+    storage += buddy_calc_overhead(cma_range);
+  }
   if (ok != 0) {
     dbg("buddy_init failed!\n");
     return 1;
   }
 
+  /* Now hand the free memory to the allocators, split at section (and
+     zone) boundaries. */
   for (unsigned i = 0; i < early_nranges; ++i) {
     if (early_ranges[i].extent == 0)
       continue;
 
     range_t r = split_range(&early_ranges[i], 0x100000);
     if (r.extent > 0)
-      buddy_free_range(&allocators[PAGE_REQ_UNDER1MB], r);
-
-    r = split_range(&early_ranges[i], 0x100000000ULL);
-    if (r.extent > 0)
-      buddy_free_range(&allocators[PAGE_REQ_UNDER4GB], r);
-
-    if (early_ranges[i].extent > 0)
-      buddy_free_range(&allocators[PAGE_REQ_NONE], early_ranges[i]);
+      buddy_free_range(&low_section.allocator, r);
+
+    while (early_ranges[i].extent > 0) {
+      uint64_t idx = early_ranges[i].start >> SECTION_SHIFT;
+      if (idx >= NUM_SECTIONS)
+        break;
+      r = split_range(&early_ranges[i], (idx + 1) << SECTION_SHIFT);
+      buddy_free_range(&sections[idx].allocator, r);
+    }
   }
 
+  for (int req = 0; req < 3; ++req)
+    init_watermarks(req);
+
   pmm_init_stage = PMM_INIT_FULL;
 
   return 0;
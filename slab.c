@@ -10,194 +10,620 @@
 #include "slab.h"
 #include "utils.h"
 
+/* Slab descriptor. This lives at the end of the slab itself (hence
+   "footer"), unless the cache keeps its metadata off-slab. */
 typedef struct slab_footer {
-  struct slab_footer *next;
+  struct slab_footer *next, *prev;  /* Links in one of the cache's lists. */
+  slab_cache_t *cache;              /* Cache the slab belongs to. */
+  uintptr_t start;                  /* Address of the slab. */
+  void *freelist;                   /* First free object, or NULL. */
+  unsigned inuse;                   /* Number of objects allocated. */
+  unsigned colour;                  /* Offset of the first object. */
+  unsigned idle_since;              /* Tick at which the slab became empty. */
 } slab_footer_t;
 
-#define SLAB_ADDR_MASK ~(SLAB_SIZE-1)
-#define FOOTER_FOR_PTR(x) (void*)(((uintptr_t) x & SLAB_ADDR_MASK) + SLAB_SIZE - sizeof(slab_footer_t))
-#define START_FOR_FOOTER(f) ((uintptr_t)f & SLAB_ADDR_MASK)
+/* Slabs are naturally aligned to their (per-cache) size. */
+#define SLAB_ADDR_MASK(c) ~((uintptr_t)(c)->slab_size-1)
+#define FOOTER_FOR_PTR(c, x) (void*)(((uintptr_t) x & SLAB_ADDR_MASK(c)) + (c)->slab_size - sizeof(slab_footer_t))
+
+/* Slab descriptor lookup.
+
+   Caches of objects of at least OFFSLAB_MIN bytes keep their descriptors in
+   desc_cache rather than at the end of each slab, so page-sized and
+   power-of-two-sized objects pack their slabs exactly.
+
+   Every slab's descriptor, wherever it lives, can be found from an address
+   through a two-level table laid out like an x86 page directory: an entry
+   per 4MB of address space points to a page of descriptor pointers, one
+   per 4KB. Each page of a slab has its entry set, so the cache that owns
+   any address can be found without knowing the slab size (see
+   slab_cache_for()). Table pages are allocated on demand and never
+   freed. */
+#define OFFSLAB_MIN      (SLAB_MIN_SIZE / 8)
+#define DESC_DIR_SHIFT   22
+#define DESC_TAB_SHIFT   12
+#define DESC_TAB_ENTRIES (1U << (DESC_DIR_SHIFT - DESC_TAB_SHIFT))
+#define DESC_DIR_ENTRIES 1024
+
+static slab_footer_t **desc_dir[DESC_DIR_ENTRIES];
+static spinlock_t desc_lock = SPINLOCK_RELEASED;
+static slab_cache_t desc_cache;
+
+#define DESC_DIR_IDX(a) ((a) >> DESC_DIR_SHIFT)
+#define DESC_TAB_IDX(a) (((a) >> DESC_TAB_SHIFT) & (DESC_TAB_ENTRIES - 1))
+
+/* Return the descriptor of the slab containing 'obj', or NULL if 'obj'
+   isn't in a slab. */
+static inline slab_footer_t *lookup_desc(uintptr_t obj) {
+  if (DESC_DIR_IDX(obj) >= DESC_DIR_ENTRIES)
+    return NULL;
+  slab_footer_t **tab = desc_dir[DESC_DIR_IDX(obj)];
+  return tab ? tab[DESC_TAB_IDX(obj)] : NULL;
+}
+
+/* Return the descriptor of the slab in 'c' containing 'obj'. */
+static inline slab_footer_t *slab_for(slab_cache_t *c, void *obj) {
+  if (!c->offslab)
+    return FOOTER_FOR_PTR(c, obj);
+  return lookup_desc((uintptr_t)obj);
+}
+
+/* Record 'f' as the descriptor of each page of the slab at 'start' (or
+   forget it, if 'f' is NULL). Returns -1 if a table page couldn't be
+   allocated. Slabs never straddle a 4MB boundary, being naturally aligned
+   and at most SLAB_MAX_SIZE bytes. */
+static int set_slab_desc(slab_cache_t *c, uintptr_t start, slab_footer_t *f) {
+  assert(DESC_DIR_IDX(start) < DESC_DIR_ENTRIES);
+
+  spinlock_acquire(&desc_lock);
+  slab_footer_t **tab = desc_dir[DESC_DIR_IDX(start)];
+  if (!tab) {
+    uintptr_t p = vmspace_alloc(c->vms, DESC_TAB_ENTRIES * sizeof(void*),
+                                /*alloc_phys=*/PAGE_WRITE, PAGE_REQ_NONE);
+    if (p == (uintptr_t)~0ULL) {
+      spinlock_release(&desc_lock);
+      return -1;
+    }
+    tab = (slab_footer_t**)p;
+    memset(tab, 0, DESC_TAB_ENTRIES * sizeof(void*));
+    desc_dir[DESC_DIR_IDX(start)] = tab;
+  }
+  for (unsigned i = 0; i < c->slab_size >> DESC_TAB_SHIFT; ++i)
+    tab[DESC_TAB_IDX(start) + i] = f;
+  spinlock_release(&desc_lock);
+  return 0;
+}
+
+slab_cache_t *slab_cache_for(void *obj) {
+  slab_footer_t *f = lookup_desc((uintptr_t)obj);
+  return f ? f->cache : NULL;
+}
+
+/* A free object holds a pointer to the next free object in its slab. */
+#define NEXT_FREE(c, obj) (*(void**)((uintptr_t)(obj) + (c)->link))
 
 /* Internal functions */
 /* Destroy a slab, given its footer. */
 static void destroy(slab_cache_t *c, slab_footer_t *f);
-/* Create a new slab, in the given cache. */
-static slab_footer_t *create(slab_cache_t *c);
-/* Mark a slab entry as used - obj is a pointer relative to the start of the slab. */
-static void mark_used(slab_cache_t *c, slab_footer_t *f, void *obj);
-/* Mark a slab entry as unused - obj is a pointer relative to the start of the slab. */
-static void mark_unused(slab_cache_t *c, slab_footer_t *f, void *obj);
-/* Predicate: are all the entries in the given slab unused? */
-static int all_unused(slab_cache_t *c, slab_footer_t *f);
-/* Return the address of an empty object in the given slab, or NULL if all full. */
-static void *find_empty_obj(slab_cache_t *c, slab_footer_t *f);
-
-int slab_cache_create(slab_cache_t *c, vmspace_t *vms, unsigned size, void *init) {
+/* Create a new slab, in the given cache. Returns NULL on failure. */
+static slab_footer_t *create(slab_cache_t *c, unsigned flags);
+/* Allocate an object from the slabs. Must be called with c->lock held. */
+static void *slab_alloc_locked(slab_cache_t *c, unsigned flags);
+/* Return an object to its slab. Must be called with c->lock held. */
+static void slab_free_locked(slab_cache_t *c, void *obj);
+/* Add a slab to the head of a list. */
+static void list_push(slab_footer_t **list, slab_footer_t *f);
+/* Remove a slab from a list. */
+static void list_remove(slab_footer_t **list, slab_footer_t *f);
+
+/* Magazines are themselves allocated from a slab cache, which has no
+   magazine layer of its own. It is set up by the first call to
+   slab_cache_create(). */
+static slab_cache_t mag_cache;
+static int mag_cache_ready;
+
+/* Every cache, for the reaper. */
+static slab_cache_t *all_caches;
+static spinlock_t all_caches_lock = SPINLOCK_RELEASED;
+
+/* Return the number of bytes wasted in a slab of 'slab_size' bytes holding
+   objects 'stride' bytes apart, with 'overhead' bytes of metadata. */
+static unsigned slab_waste(unsigned slab_size, unsigned stride,
+                           unsigned overhead) {
+  unsigned avail = slab_size - overhead;
+  return (avail < stride) ? slab_size : avail % stride;
+}
+
+/* Choose the smallest slab size that wastes at most SLAB_WASTE_PCT percent
+   of the slab. If none does, choose the one that wastes the least. */
+static unsigned pick_slab_size(unsigned stride, unsigned overhead) {
+  unsigned best = 0, best_waste = 0;
+  for (unsigned sz = SLAB_MIN_SIZE; sz <= SLAB_MAX_SIZE; sz <<= 1) {
+    unsigned waste = slab_waste(sz, stride, overhead);
+    if (waste * 100 <= sz * SLAB_WASTE_PCT)
+      return sz;
+    /* Compare waste/sz against best_waste/best. */
+    if (best == 0 || (uint64_t)waste * best < (uint64_t)best_waste * sz) {
+      best = sz;
+      best_waste = waste;
+    }
+  }
+  return best;
+}
+
+int slab_cache_create(slab_cache_t *c, vmspace_t *vms, unsigned size,
+                      slab_ctor_t ctor, slab_dtor_t dtor) {
+  if (!mag_cache_ready) {
+    mag_cache_ready = 1;
+    slab_cache_create(&mag_cache, vms, sizeof(slab_magazine_t), NULL, NULL);
+    mag_cache.mag_size = 0;
+    slab_cache_create(&desc_cache, vms, sizeof(slab_footer_t), NULL, NULL);
+    desc_cache.mag_size = 0;
+  }
+
   c->size = size;
-  c->init = init;
-  c->first = NULL;
-  c->empty = NULL;
+  c->stride = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  c->link = 0;
+  if (ctor) {
+    c->link = c->stride;
+    c->stride += sizeof(void*);
+  }
+  c->offslab = c->stride >= OFFSLAB_MIN;
+  unsigned overhead = c->offslab ? 0 : sizeof(slab_footer_t);
+  c->slab_size = pick_slab_size(c->stride, overhead);
+  c->nobjs = (c->slab_size - overhead) / c->stride;
+  c->colour_max = 0;
+  c->colour_next = 0;
+  if (c->nobjs > 0) {
+    unsigned slack = c->slab_size - overhead - c->nobjs * c->stride;
+    c->colour_max = slack & ~(SLAB_COLOUR_ALIGN - 1);
+  }
+  c->ctor = ctor;
+  c->dtor = dtor;
+  c->partial = c->full = c->empty = NULL;
+  c->nempty = 0;
+  c->empty_max = SLAB_EMPTY_DEFAULT;
   c->vms = vms;
+  c->mag_size = SLAB_MAG_DEFAULT;
+  memset(c->cpus, 0, sizeof(c->cpus));
+  c->depot_full = c->depot_empty = NULL;
+  c->nfull = 0;
   spinlock_init(&c->lock);
+  c->next_cache = NULL;
+
+  if (c->nobjs == 0)
+    return -1;
+
+  spinlock_acquire(&all_caches_lock);
+  c->next_cache = all_caches;
+  all_caches = c;
+  spinlock_release(&all_caches_lock);
   return 0;
 }
 
-int slab_cache_destroy(slab_cache_t *c) {
-  slab_footer_t *s = c->first;
-  while (s) {
-    slab_footer_t *s_ = s->next;
-    destroy(c, s);
-    s = s_;
+/* Return the rounds in a magazine to the slabs, and free the magazine.
+   Must be called with c->lock held. */
+static void flush_magazine_locked(slab_cache_t *c, slab_magazine_t *m) {
+  while (m->rounds > 0)
+    slab_free_locked(c, m->objs[--m->rounds]);
+  slab_cache_free(&mag_cache, m);
+}
+
+/* Flush every magazine in the depot, and 'cpu's magazines if given. Must be
+   called with c->lock held. */
+static void drain_locked(slab_cache_t *c, slab_cpu_t *cpu) {
+  slab_magazine_t *lists[2] = { c->depot_full, c->depot_empty };
+  for (unsigned i = 0; i < 2; ++i) {
+    slab_magazine_t *m = lists[i];
+    while (m) {
+      slab_magazine_t *m_ = m->next;
+      flush_magazine_locked(c, m);
+      m = m_;
+    }
+  }
+  c->depot_full = c->depot_empty = NULL;
+  c->nfull = 0;
+
+  if (cpu) {
+    if (cpu->loaded)
+      flush_magazine_locked(c, cpu->loaded);
+    if (cpu->prev)
+      flush_magazine_locked(c, cpu->prev);
+    cpu->loaded = cpu->prev = NULL;
   }
-  c->first = NULL;
-  return 0;
 }
 
-void *slab_cache_alloc(slab_cache_t *c) {
+/* Take c->lock, unless 'flags' has SLAB_ATOMIC and someone else holds it.
+   Returns zero if the lock wasn't taken. */
+static int lock_cache(slab_cache_t *c, unsigned flags) {
+  if (flags & SLAB_ATOMIC)
+    return spinlock_try_acquire(&c->lock);
   spinlock_acquire(&c->lock);
+  return 1;
+}
 
-  void *obj;
-  if (c->empty) {
+static slab_cpu_t *get_cpu(slab_cache_t *c) {
+  int n = get_current_cpucore();
+  return (c->mag_size > 0 && n < SLAB_MAX_CPUS) ? &c->cpus[n] : NULL;
+}
 
-    obj = c->empty;
-    slab_footer_t *f = FOOTER_FOR_PTR(obj);
-    mark_used(c, f, obj);
+/* Take an object from this CPU's magazines, exchanging them with the depot
+   if need be. Returns NULL if the depot has no full magazines either (or,
+   with SLAB_ATOMIC, if its lock is busy). Must be called with interrupts
+   disabled. */
+static void *mag_alloc(slab_cache_t *c, slab_cpu_t *cpu, unsigned flags) {
+  for (;;) {
+    if (cpu->loaded && cpu->loaded->rounds > 0)
+      return cpu->loaded->objs[--cpu->loaded->rounds];
+
+    if (cpu->prev && cpu->prev->rounds > 0) {
+      slab_magazine_t *m = cpu->loaded;
+      cpu->loaded = cpu->prev;
+      cpu->prev = m;
+      continue;
+    }
 
-    while (f) {
-      c->empty = find_empty_obj(c, f);
-      if (c->empty) break;
-      f = f->next;
+    /* Both magazines are empty - give one back to the depot in exchange
+       for a full one. */
+    if (!lock_cache(c, flags))
+      return NULL;
+    slab_magazine_t *m = c->depot_full;
+    if (m) {
+      c->depot_full = m->next;
+      --c->nfull;
+      if (cpu->prev) {
+        cpu->prev->idle_since = (unsigned)uptime_jiffies();
+        cpu->prev->next = c->depot_empty;
+        c->depot_empty = cpu->prev;
+      }
+      cpu->prev = cpu->loaded;
+      cpu->loaded = m;
     }
+    spinlock_release(&c->lock);
 
-  } else {
+    if (!m)
+      return NULL;
+  }
+}
 
-    /* No empty pointer - must create a new slab. */
-    slab_footer_t *f = c->first;
-    c->first = create(c);
-    c->first->next = f;
-    
-    obj = (void*)START_FOR_FOOTER(c->first);
-    mark_used(c, c->first, obj);
+/* Put an object into this CPU's magazines, exchanging them with the depot
+   if need be. Returns 0 if no empty magazine could be found. Must be
+   called with interrupts disabled. */
+static int mag_free(slab_cache_t *c, slab_cpu_t *cpu, void *obj) {
+  for (;;) {
+    if (cpu->loaded && cpu->loaded->rounds < c->mag_size) {
+      cpu->loaded->objs[cpu->loaded->rounds++] = obj;
+      return 1;
+    }
 
-    c->empty = find_empty_obj(c, c->first);
+    if (cpu->prev && cpu->prev->rounds < c->mag_size) {
+      slab_magazine_t *m = cpu->loaded;
+      cpu->loaded = cpu->prev;
+      cpu->prev = m;
+      continue;
+    }
 
+    /* Both magazines are full - give one to the depot in exchange for an
+       empty one, making a new one if the depot has none. If the depot
+       already holds as many full magazines as it may, return the rounds
+       to the slabs instead and reuse the magazine. */
+    slab_magazine_t *m = NULL;
+    spinlock_acquire(&c->lock);
+    if (cpu->prev) {
+      if (c->nfull < SLAB_DEPOT_MAX) {
+        cpu->prev->idle_since = (unsigned)uptime_jiffies();
+        cpu->prev->next = c->depot_full;
+        c->depot_full = cpu->prev;
+        ++c->nfull;
+      } else {
+        m = cpu->prev;
+        while (m->rounds > 0)
+          slab_free_locked(c, m->objs[--m->rounds]);
+      }
+      cpu->prev = NULL;
+    }
+    if (!m && (m = c->depot_empty) != NULL)
+      c->depot_empty = m->next;
+    spinlock_release(&c->lock);
+
+    if (!m) {
+      if ((m = slab_cache_alloc(&mag_cache)) == NULL)
+        return 0;
+      m->rounds = 0;
+    }
+
+    cpu->prev = cpu->loaded;
+    cpu->loaded = m;
   }
-  if (c->init)
-    memcpy(obj, c->init, c->size);
+}
 
-  spinlock_release(&c->lock);
-  return obj;
+/* As get_cpu(), but regardless of whether the magazine layer is enabled. */
+static slab_cpu_t *cpu_for_drain(slab_cache_t *c) {
+  int n = get_current_cpucore();
+  return (n < SLAB_MAX_CPUS) ? &c->cpus[n] : NULL;
 }
 
-void slab_cache_free(slab_cache_t *c, void *obj) {
+int slab_cache_set_magazine_size(slab_cache_t *c, unsigned rounds) {
+  if (rounds > SLAB_MAG_MAX || c == &mag_cache)
+    return -1;
+
   spinlock_acquire(&c->lock);
-  assert(c->first && "Trying to free from an empty cache!");
-  
-  slab_footer_t *f = FOOTER_FOR_PTR(obj);
+  c->mag_size = rounds;
+  if (rounds == 0)
+    drain_locked(c, cpu_for_drain(c));
+  spinlock_release(&c->lock);
+  return 0;
+}
 
-  mark_unused(c, f, obj);
+void slab_cache_drain(slab_cache_t *c) {
+  spinlock_acquire(&c->lock);
+  drain_locked(c, cpu_for_drain(c));
+  spinlock_release(&c->lock);
+}
 
-  if (!c->empty || c->empty > obj)
-    c->empty = obj;
+/* Destroy all but the 'keep' most recently emptied slabs and, if 'idle'
+   is nonzero, any that have been empty for 'idle' ticks or more at 'now'.
+   Must be called with c->lock held. */
+static void reap_locked(slab_cache_t *c, unsigned keep, unsigned now,
+                        unsigned idle) {
+  slab_footer_t *f = c->empty;
+  for (unsigned i = 0; f; ++i) {
+    slab_footer_t *f_ = f->next;
+    if (i >= keep || (idle && now - f->idle_since >= idle)) {
+      list_remove(&c->empty, f);
+      --c->nempty;
+      destroy(c, f);
+    }
+    f = f_;
+  }
+}
 
-  if (!f->next && all_unused(c, f)) {
-    slab_footer_t *f2 = c->first;
-    if (f2 == f) {
-      c->first = NULL;
-    } else {
-      while (f2->next != f)
-        f2 = f2->next;
-      f2->next = NULL;
+/* Flush the magazines, full and empty, that have sat in the depot for
+   'idle' ticks or more at 'now'. Each list is newest first, so once one
+   old magazine is found, the rest are older. Must be called with c->lock
+   held. */
+static void reap_depot_locked(slab_cache_t *c, unsigned now, unsigned idle) {
+  slab_magazine_t **lists[2] = { &c->depot_full, &c->depot_empty };
+  for (unsigned i = 0; i < 2; ++i) {
+    slab_magazine_t **pm = lists[i];
+    while (*pm && now - (*pm)->idle_since < idle)
+      pm = &(*pm)->next;
+
+    slab_magazine_t *m = *pm;
+    *pm = NULL;
+    while (m) {
+      slab_magazine_t *m_ = m->next;
+      if (i == 0)
+        --c->nfull;
+      flush_magazine_locked(c, m);
+      m = m_;
     }
-    if (FOOTER_FOR_PTR(c->empty) == f)
-      c->empty = NULL;
-    destroy(c, f);
   }
-  spinlock_release(&c->lock);
 }
 
-static void destroy(slab_cache_t *c, slab_footer_t *f) {
-  vmspace_free(c->vms, SLAB_SIZE, START_FOR_FOOTER(f), /*free_phys=*/1);
+int slab_cache_set_empty_max(slab_cache_t *c, unsigned n) {
+  spinlock_acquire(&c->lock);
+  c->empty_max = n;
+  reap_locked(c, n, 0, 0);
+  spinlock_release(&c->lock);
+  return 0;
 }
 
-/* Return the number of entries in a bitmap for an object of 'obj_sz'. */
-static inline unsigned bitmap_num(int obj_sz) {
-  unsigned avail = SLAB_SIZE - sizeof(slab_footer_t);
-  return avail / obj_sz;
+void slab_reap() {
+  unsigned now = (unsigned)uptime_jiffies();
+
+  spinlock_acquire(&all_caches_lock);
+  for (slab_cache_t *c = all_caches; c; c = c->next_cache) {
+    spinlock_acquire(&c->lock);
+    /* Flushing the depot may empty slabs, which are then kept or reaped
+       as usual. */
+    reap_depot_locked(c, now, SLAB_REAP_IDLE);
+    reap_locked(c, c->empty_max, now, SLAB_REAP_IDLE);
+    spinlock_release(&c->lock);
+  }
+  spinlock_release(&all_caches_lock);
 }
 
-/* Return the size in bytes of a bitmap for an object of 'obj_sz'. */
-static inline unsigned bitmap_sz(int obj_sz) {
-  return bitmap_num(obj_sz) / 8 + 1;
+int slab_cache_destroy(slab_cache_t *c) {
+  spinlock_acquire(&all_caches_lock);
+  slab_cache_t **pc = &all_caches;
+  while (*pc && *pc != c)
+    pc = &(*pc)->next_cache;
+  if (*pc)
+    *pc = c->next_cache;
+  spinlock_release(&all_caches_lock);
+
+  /* The cache must no longer be in use, so every CPU's magazines can be
+     flushed. */
+  spinlock_acquire(&c->lock);
+  for (unsigned i = 0; i < SLAB_MAX_CPUS; ++i)
+    drain_locked(c, &c->cpus[i]);
+  spinlock_release(&c->lock);
+
+  slab_footer_t **lists[3] = { &c->partial, &c->full, &c->empty };
+  for (unsigned i = 0; i < 3; ++i) {
+    slab_footer_t *s = *lists[i];
+    while (s) {
+      slab_footer_t *s_ = s->next;
+      destroy(c, s);
+      s = s_;
+    }
+    *lists[i] = NULL;
+  }
+  c->nempty = 0;
+  return 0;
 }
 
-/* Return the bitmap entry index that represents 'obj'. */
-static inline unsigned bitmap_idx(slab_footer_t *f, void *obj, int obj_sz) {
-  return ( (uintptr_t)obj - START_FOR_FOOTER(f) ) / obj_sz;
+void *slab_cache_alloc(slab_cache_t *c) {
+  return slab_cache_alloc_flags(c, 0);
 }
 
-static slab_footer_t *create(slab_cache_t *c) {
-  uintptr_t addr = vmspace_alloc(c->vms, SLAB_SIZE, /*alloc_phys=*/PAGE_WRITE);
+void *slab_cache_alloc_flags(slab_cache_t *c, unsigned flags) {
+  assert(!((flags & SLAB_ZERO) && c->ctor) &&
+         "Can't zero objects from a cache with a constructor!");
 
-  slab_footer_t *f = FOOTER_FOR_PTR(addr);
-  f->next = NULL;
-  
-  /* Initialise the used/free bitmap. */
-  uintptr_t bm = (uintptr_t)f - bitmap_sz(c->size);
-  memset((uint8_t*)bm, 0, bitmap_sz(c->size));
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
 
-  return f;
-}
+  void *obj = NULL;
+  slab_cpu_t *cpu = get_cpu(c);
+  if (cpu)
+    obj = mag_alloc(c, cpu, flags);
+
+  if (!obj && lock_cache(c, flags)) {
+    obj = slab_alloc_locked(c, flags);
+    spinlock_release(&c->lock);
+  }
 
-static void mark_used(slab_cache_t *c, slab_footer_t *f, void *obj) {
-  unsigned idx = bitmap_idx(f, obj, c->size);
-  unsigned sz = bitmap_sz(c->size);
+  if (interrupts)
+    enable_interrupts();
 
-  unsigned byte = idx >> 3;
-  unsigned bit = idx & 7;
-  uint8_t *ptr = (uint8_t*)f - sz + byte;
-  *ptr |= 1 << bit;
+  if (obj && (flags & SLAB_ZERO))
+    memset(obj, 0, c->size);
+  return obj;
 }
 
-static void mark_unused(slab_cache_t *c, slab_footer_t *f, void *obj) {
-  unsigned idx = bitmap_idx(f, obj, c->size);
-  unsigned sz = bitmap_sz(c->size);
+void slab_cache_free(slab_cache_t *c, void *obj) {
+  int interrupts = get_interrupt_state();
+  disable_interrupts();
+
+  slab_cpu_t *cpu = get_cpu(c);
+  if (!cpu || !mag_free(c, cpu, obj)) {
+    spinlock_acquire(&c->lock);
+    slab_free_locked(c, obj);
+    spinlock_release(&c->lock);
+  }
 
-  unsigned byte = idx >> 3;
-  unsigned bit = idx & 7;
-  uint8_t *ptr = (uint8_t*)f - sz + byte;
-  *ptr &= ~(1 << bit);
+  if (interrupts)
+    enable_interrupts();
 }
 
-static int all_unused(slab_cache_t *c, slab_footer_t *f) {
-  unsigned sz = bitmap_sz(c->size);
-  uint8_t *p = (uint8_t*)f - sz;
+static void *slab_alloc_locked(slab_cache_t *c, unsigned flags) {
+  slab_footer_t *f = c->partial;
+  if (!f) {
+    /* No partial slabs - reuse an empty one, or make a new one. */
+    if (c->empty) {
+      f = c->empty;
+      list_remove(&c->empty, f);
+      --c->nempty;
+    } else if ((flags & SLAB_ATOMIC) || (f = create(c, flags)) == NULL) {
+      return NULL;
+    }
+    list_push(&c->partial, f);
+  }
 
-  /* FIXME: Use something fast like memcmp? */
-  for (unsigned i = 0; i < sz; ++i)
-    if (*p++ != 0) return 0;
-  return 1;
-}
+  void *obj = f->freelist;
+  f->freelist = NEXT_FREE(c, obj);
 
-static int lsb_clear(uint8_t byte) {
-  int i = 0;
-  while ((byte & 1) == 1) {
-    ++i;
-    byte >>= 1;
+  if (++f->inuse == c->nobjs) {
+    list_remove(&c->partial, f);
+    list_push(&c->full, f);
   }
-  return i;
+  return obj;
 }
 
-static void *find_empty_obj(slab_cache_t *c, slab_footer_t *f) {
-  unsigned sz = bitmap_sz(c->size);
-  uint8_t *p = (uint8_t*)f - sz;
+static void slab_free_locked(slab_cache_t *c, void *obj) {
+  slab_footer_t *f = slab_for(c, obj);
+  assert(f->inuse > 0 && "Trying to free from an empty slab!");
+
+  NEXT_FREE(c, obj) = f->freelist;
+  f->freelist = obj;
 
-  for (unsigned i = 0; i < sz; ++i) {
-    if (*p != 0xFF) {
-      unsigned idx = i * 8 + lsb_clear(*p);
-      return (idx >= bitmap_num(c->size)) ? NULL : (void*)(START_FOR_FOOTER(f) + c->size*idx);
+  if (f->inuse-- == c->nobjs) {
+    list_remove(&c->full, f);
+    list_push(&c->partial, f);
+  }
+
+  if (f->inuse == 0) {
+    list_remove(&c->partial, f);
+    /* Keep a few empty slabs around, so a cache that hovers around a slab
+       boundary doesn't create and destroy a slab on every call. The most
+       recently emptied slab is reused first; the reaper gets rid of ones
+       that stay idle. */
+    if (c->nempty >= c->empty_max) {
+      destroy(c, f);
+    } else {
+      f->idle_since = (unsigned)uptime_jiffies();
+      list_push(&c->empty, f);
+      ++c->nempty;
     }
-    ++p;
   }
-  return NULL;
+}
+
+static void destroy(slab_cache_t *c, slab_footer_t *f) {
+  if (c->dtor) {
+    uintptr_t start = f->start + f->colour;
+    for (unsigned i = 0; i < c->nobjs; ++i)
+      c->dtor((void*)(start + i * c->stride));
+  }
+  uintptr_t start = f->start;
+  set_slab_desc(c, start, NULL);
+  if (c->offslab)
+    slab_cache_free(&desc_cache, f);
+
+  vmspace_free(c->vms, c->slab_size, start, /*free_phys=*/1);
+}
+
+static slab_footer_t *create(slab_cache_t *c, unsigned flags) {
+  int req = (flags & SLAB_RESERVE) ? PAGE_REQ_RESERVE : PAGE_REQ_NONE;
+  uintptr_t addr = vmspace_alloc(c->vms, c->slab_size, /*alloc_phys=*/PAGE_WRITE,
+                                 req);
+  if (addr == (uintptr_t)~0ULL)
+    return NULL;
+
+  slab_footer_t *f;
+  if (c->offslab)
+    f = slab_cache_alloc(&desc_cache);
+  else
+    f = FOOTER_FOR_PTR(c, addr);
+
+  if (!f || set_slab_desc(c, addr, f) == -1) {
+    if (f && c->offslab)
+      slab_cache_free(&desc_cache, f);
+    vmspace_free(c->vms, c->slab_size, addr, /*free_phys=*/1);
+    return NULL;
+  }
+  f->cache = c;
+  f->start = addr;
+  f->next = f->prev = NULL;
+  f->inuse = 0;
+
+  /* Colour the slab: start its objects at an offset that steps through
+     the slack space a cache line at a time, so the first objects of
+     successive slabs don't all compete for the same cache sets. */
+  f->colour = c->colour_next;
+  uintptr_t start = addr + f->colour;
+  c->colour_next += SLAB_COLOUR_ALIGN;
+  if (c->colour_next > c->colour_max)
+    c->colour_next = 0;
+
+  /* Thread the freelist through the objects, lowest address first. */
+  f->freelist = NULL;
+  for (unsigned i = c->nobjs; i-- > 0; ) {
+    void *obj = (void*)(start + i * c->stride);
+    if (c->ctor)
+      c->ctor(obj);
+    NEXT_FREE(c, obj) = f->freelist;
+    f->freelist = obj;
+  }
+
+  return f;
+}
+
+static void list_push(slab_footer_t **list, slab_footer_t *f) {
+  f->prev = NULL;
+  f->next = *list;
+  if (*list)
+    (*list)->prev = f;
+  *list = f;
+}
+
+static void list_remove(slab_footer_t **list, slab_footer_t *f) {
+  if (f->prev)
+    f->prev->next = f->next;
+  else
+    *list = f->next;
+  if (f->next)
+    f->next->prev = f->prev;
+  f->next = f->prev = NULL;
 }
@@ -0,0 +1,86 @@
+/* Host-side benchmark for the bitmap ADT.
+ *
+ * Measures the cost of bitmap_first_set() on a bitmap the size of the
+ * order-0 buddy bitmap for 256MB of 4KB pages, with and without the
+ * summary level, against the original byte-at-a-time scan.
+ *
+ * Copyright (c)2018 Ross Bamford. See LICENSE for details.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bitmap.c"
+
+#define NBITS   (1 << 16)
+#define ITERS   20000
+
+/* The original byte-at-a-time scan, kept for comparison. */
+static int64_t bytewise_first_set(const uint8_t *data, int64_t max_extent) {
+  for (int64_t i = 0; i < (max_extent >> 3) + 1; i++) {
+    if (data[i] == 0) continue;
+
+    uint8_t byte = data[i];
+    int bit = 0;
+    while ((byte & 1) == 0) {
+      ++bit;
+      byte >>= 1;
+    }
+    int64_t idx = i * 8 + bit;
+    return (idx > max_extent) ? -1 : idx;
+  }
+  return -1;
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Time ITERS lookups with a single set bit at each of a spread of
+   positions, and return the mean cost of a lookup in ns. */
+static double bench(bitmap_t *bm, int bytewise) {
+  volatile int64_t sink = 0;
+  double total = 0;
+  unsigned samples = 0;
+
+  for (unsigned pos = 1; pos < NBITS; pos = pos * 2 + 1) {
+    bitmap_set(bm, pos);
+
+    double t0 = now_ns();
+    for (unsigned i = 0; i < ITERS; ++i) {
+      if (bytewise)
+        sink += bytewise_first_set((uint8_t*)bm->data, bm->max_extent);
+      else
+        sink += bitmap_first_set(bm);
+    }
+    total += now_ns() - t0;
+    samples += ITERS;
+
+    bitmap_clear(bm, pos);
+  }
+
+  (void)sink;
+  return total / samples;
+}
+
+int main() {
+  bitmap_t plain, summary;
+  uint8_t *s1 = malloc(bitmap_calc_size(NBITS - 1, 0));
+  uint8_t *s2 = malloc(bitmap_calc_size(NBITS - 1, 1));
+
+  bitmap_init(&plain, s1, NBITS - 1);
+  bitmap_init_summary(&summary, s2, NBITS - 1);
+
+  printf("bitmap_first_set, %d bits, mean over set-bit positions:\n", NBITS);
+  printf("  bytewise (original): %10.1f ns/op\n", bench(&plain, 1));
+  printf("  word-at-a-time:      %10.1f ns/op\n", bench(&plain, 0));
+  printf("  word + summary:      %10.1f ns/op\n", bench(&summary, 0));
+
+  free(s1);
+  free(s2);
+  return 0;
+}
@@ -0,0 +1,81 @@
+/* hal_stub.h - Host stand-ins for the parts of hal.h that the memory
+ * allocators need, so that their sources can be included directly into
+ * unit tests and host tools. Include this before any kernel source.
+ *
+ * Locks are checked rather than spun on: acquiring one that is already
+ * held is a bug on a single host thread, so it panics. Each includer
+ * supplies panic() (and anything else it needs beyond this).
+ *
+ * Copyright (c)2018 Ross Bamford. See LICENSE for details.
+ */
+#ifndef __MINK_HAL_STUB_H
+#define __MINK_HAL_STUB_H
+
+#include <stdint.h>
+
+#define _MINK_HAL_H
+
+#define PAGE_WRITE 1
+#define PAGE_USER  4
+
+#define PAGE_REQ_NONE      0
+#define PAGE_REQ_UNDER4GB  2
+#define PAGE_REQ_ZONE_MASK 0xFF
+#define PAGE_REQ_ZERO      0x100
+#define PAGE_REQ_RESERVE   0x200
+
+typedef struct range {
+  uint64_t start;
+  uint64_t extent;
+} range_t;
+
+void panic(const char *msg, ...);
+
+typedef struct spinlock {
+  volatile unsigned val;
+} spinlock_t;
+#define SPINLOCK_RELEASED {.val=0}
+
+static inline void spinlock_init(spinlock_t *l) { l->val = 0; }
+static inline void spinlock_acquire(spinlock_t *l) {
+  if (l->val)
+    panic("Lock already held!");
+  l->val = 1;
+}
+static inline int spinlock_try_acquire(spinlock_t *l) {
+  if (l->val)
+    return 0;
+  l->val = 1;
+  return 1;
+}
+static inline void spinlock_release(spinlock_t *l) { l->val = 0; }
+
+/* Tests check that interrupts are back on after each call. */
+static int interrupts = 1;
+static inline int get_interrupt_state() { return interrupts; }
+static inline void disable_interrupts() { interrupts = 0; }
+static inline void enable_interrupts() { interrupts = 1; }
+static inline int get_current_cpucore() { return 0; }
+
+static unsigned long long jiffies;
+static inline unsigned long long uptime_jiffies() { return jiffies; }
+
+static inline unsigned get_page_size() { return 0x1000; }
+static inline unsigned get_page_shift() { return 12; }
+static inline uintptr_t round_to_page_size(uintptr_t x) {
+  return (x + 0xFFF) & ~(uintptr_t)0xFFF;
+}
+
+typedef struct feature_prereq {
+  const char *name;
+  struct feature *feature;
+} feature_prereq_t;
+typedef struct feature {
+  const char *name;
+  feature_prereq_t *required;
+  feature_prereq_t *load_after;
+  int (*init)(void);
+} feature_t;
+#define MINK_FEATURE __attribute__((unused))
+
+#endif
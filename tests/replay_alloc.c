@@ -0,0 +1,340 @@
+/* Host-side replay of allocation traces.
+ *
+ * Reads a log recorded by a kernel built with ALLOC_TRACE (see
+ * alloctrace.h) and replays its kmalloc, kmalloc_aligned, krealloc and
+ * kfree calls against the real buddy, vmspace, slab and kmalloc code, with
+ * the PMM and page tables stubbed out. Reports the replay rate, the
+ * physical pages the heap held at its peak and at the end, and how that
+ * compares with the bytes actually requested.
+ *
+ * Page allocator events can't be told apart from the heap's own backing
+ * pages, so they are summarised rather than replayed.
+ *
+ *   make -C tests replay
+ *   ./tests/replay_alloc.replay serial.log
+ *
+ * Copyright (c)2018 Ross Bamford. See LICENSE for details.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "hal_stub.h"
+
+#include "elf.h"
+static unsigned get_stack_trace(uintptr_t *pcs, unsigned max, unsigned skip) {
+  return 0;
+}
+static elf_t *get_kernel_elf() { return NULL; }
+const char *elf_lookup_symbol(uint32_t addr, elf_t *elf) { return NULL; }
+
+void printk(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+}
+
+void panic(const char *msg, ...) {
+  va_list ap;
+  va_start(ap, msg);
+  fprintf(stderr, "panic: ");
+  vfprintf(stderr, msg, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  abort();
+}
+
+/* Page tables and the PMM. The heap's address space is a real host mapping
+   (so objects can be written to); "physical" pages are just numbers, and
+   only the count of those in use matters. */
+#define MMAP_KERNEL_VMSPACE_START 0x40000000UL
+#define MMAP_KERNEL_VMSPACE_END   0x60000000UL
+#define ARENA_PAGES ((MMAP_KERNEL_VMSPACE_END - MMAP_KERNEL_VMSPACE_START) >> 12)
+
+static uint32_t *frames;        /* Frame mapped at each arena page, or 0. */
+static uint64_t next_frame = 1;
+static uint64_t *free_frames;
+static size_t nfree_frames, free_frames_max;
+static unsigned rss, rss_peak;
+
+static size_t arena_page(uintptr_t v) {
+  if (v < MMAP_KERNEL_VMSPACE_START || v >= MMAP_KERNEL_VMSPACE_END)
+    panic("address %lx outside the arena", (unsigned long)v);
+  return (v - MMAP_KERNEL_VMSPACE_START) >> 12;
+}
+
+static int map(uintptr_t v, uint64_t p, int num_pages, unsigned flags) {
+  for (int i = 0; i < num_pages; ++i)
+    frames[arena_page(v) + i] = (uint32_t)(p >> 12) + i;
+  return 0;
+}
+
+static int unmap(uintptr_t v, int num_pages) {
+  for (int i = 0; i < num_pages; ++i)
+    frames[arena_page(v) + i] = 0;
+  /* Hand the memory back to the host too; it reads as zero next time. */
+  madvise((void*)v, (size_t)num_pages << 12, MADV_DONTNEED);
+  return 0;
+}
+
+static uint64_t get_mapping(uintptr_t v, unsigned *flags) {
+  uint32_t f = frames[arena_page(v)];
+  return f ? (uint64_t)f << 12 : ~0ULL;
+}
+
+static int alloc_pages_bulk(int req, size_t num, uint64_t *pages) {
+  for (size_t i = 0; i < num; ++i)
+    pages[i] = (nfree_frames ? free_frames[--nfree_frames] : next_frame++) << 12;
+  rss += num;
+  if (rss > rss_peak)
+    rss_peak = rss;
+  return 0;
+}
+
+static int free_page(uint64_t page) {
+  if (nfree_frames == free_frames_max) {
+    free_frames_max = free_frames_max ? free_frames_max * 2 : 1024;
+    free_frames = realloc(free_frames, free_frames_max * sizeof(uint64_t));
+  }
+  free_frames[nfree_frames++] = page >> 12;
+  --rss;
+  return 0;
+}
+
+static int free_pages_bulk(uint64_t *pages, size_t num) {
+  for (size_t i = 0; i < num; ++i)
+    free_page(pages[i]);
+  return 0;
+}
+
+#include "bitmap.c"
+#include "buddy.c"
+#include "vmspace.c"
+#include "slab.c"
+#include "kmalloc.c"
+
+/* Events, parsed up front so that the timed loop is just the allocator. */
+typedef struct event {
+  char op;
+  uint32_t size, addr, arg, time;
+} event_t;
+
+static event_t *events;
+static size_t nevents;
+
+/* Trace address -> replayed object, open addressed with linear probing and
+   backward-shift deletion. */
+#define LIVE_BITS 20
+#define LIVE_SIZE (1U << LIVE_BITS)
+
+typedef struct live {
+  uint32_t addr;               /* 0 if the slot is empty. */
+  uint32_t size;
+  void *obj;
+} live_t;
+
+static live_t *live;
+static unsigned nlive;
+static unsigned long long live_bytes, live_bytes_peak;
+
+static unsigned live_hash(uint32_t addr) {
+  return (addr * 2654435761U) >> (32 - LIVE_BITS);
+}
+
+static live_t *live_find(uint32_t addr) {
+  for (unsigned i = live_hash(addr); live[i].addr; i = (i + 1) & (LIVE_SIZE - 1))
+    if (live[i].addr == addr)
+      return &live[i];
+  return NULL;
+}
+
+static void live_insert(uint32_t addr, uint32_t size, void *obj) {
+  if (nlive >= LIVE_SIZE / 2)
+    panic("more than %u live objects", LIVE_SIZE / 2);
+
+  unsigned i = live_hash(addr);
+  while (live[i].addr)
+    i = (i + 1) & (LIVE_SIZE - 1);
+  live[i].addr = addr;
+  live[i].size = size;
+  live[i].obj = obj;
+  ++nlive;
+  live_bytes += size;
+  if (live_bytes > live_bytes_peak)
+    live_bytes_peak = live_bytes;
+}
+
+static void live_remove(live_t *l) {
+  unsigned i = l - live;
+  live_bytes -= l->size;
+  --nlive;
+
+  for (unsigned j = (i + 1) & (LIVE_SIZE - 1); live[j].addr;
+       j = (j + 1) & (LIVE_SIZE - 1)) {
+    unsigned h = live_hash(live[j].addr);
+    /* Move j back into the hole if its home slot isn't between the hole
+       and j. */
+    if (((j - h) & (LIVE_SIZE - 1)) >= ((j - i) & (LIVE_SIZE - 1))) {
+      live[i] = live[j];
+      i = j;
+    }
+  }
+  live[i].addr = 0;
+}
+
+/* Counts of things in the trace that didn't line up. */
+static unsigned ndropped, nunmatched, nstale, nfailed;
+static unsigned trace_pages, trace_pages_peak;
+
+/* If 'addr' is still live, the kernel must have freed it in an event that
+   was dropped. */
+static void free_stale(uint32_t addr) {
+  live_t *l = live_find(addr);
+  if (l) {
+    kfree(l->obj);
+    live_remove(l);
+    ++nstale;
+  }
+}
+
+static void replay(const event_t *e) {
+  void *p;
+  live_t *l;
+
+  while (jiffies < e->time) {
+    ++jiffies;
+    if (jiffies % SLAB_REAP_INTERVAL == 0)
+      slab_reap();
+  }
+
+  switch (e->op) {
+  case TRACE_KMALLOC:
+  case TRACE_KALIGNED:
+    free_stale(e->addr);
+    if (e->op == TRACE_KMALLOC)
+      p = kmalloc_flags(e->size, e->arg);
+    else
+      p = kmalloc_aligned(e->size, e->arg);
+    if (p)
+      live_insert(e->addr, e->size, p);
+    else
+      ++nfailed;
+    break;
+
+  case TRACE_KREALLOC:
+    if ((l = live_find(e->arg)) == NULL) {
+      ++nunmatched;
+      break;
+    }
+    p = krealloc(l->obj, e->size);
+    if (!p) {
+      ++nfailed;
+      break;
+    }
+    live_remove(l);
+    free_stale(e->addr);
+    live_insert(e->addr, e->size, p);
+    break;
+
+  case TRACE_KFREE:
+    if ((l = live_find(e->addr)) == NULL) {
+      ++nunmatched;
+      break;
+    }
+    kfree(l->obj);
+    live_remove(l);
+    break;
+
+  case TRACE_PAGES:
+    trace_pages += e->size;
+    if (trace_pages > trace_pages_peak)
+      trace_pages_peak = trace_pages;
+    break;
+
+  case TRACE_FREEPAGES:
+    /* Pages allocated before tracing began may be freed. */
+    trace_pages -= (e->size < trace_pages) ? e->size : trace_pages;
+    break;
+
+  case TRACE_DROPPED:
+    ndropped += e->size;
+    break;
+  }
+}
+
+static void load(FILE *f) {
+  char line[256];
+  size_t max = 0;
+
+  while (fgets(line, sizeof(line), f)) {
+    event_t e;
+    /* Anything else on the console is not ours. */
+    if (sscanf(line, "T%c %x %x %x %x", &e.op, &e.size, &e.addr, &e.arg,
+               &e.time) != 5)
+      continue;
+    if (nevents == max) {
+      max = max ? max * 2 : 4096;
+      events = realloc(events, max * sizeof(event_t));
+    }
+    events[nevents++] = e;
+  }
+}
+
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+  FILE *f = stdin;
+  if (argc > 1 && (f = fopen(argv[1], "r")) == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  load(f);
+  if (f != stdin)
+    fclose(f);
+
+  if (mmap((void*)MMAP_KERNEL_VMSPACE_START,
+           MMAP_KERNEL_VMSPACE_END - MMAP_KERNEL_VMSPACE_START,
+           PROT_READ|PROT_WRITE,
+           MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE, -1, 0) ==
+      MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  frames = calloc(ARENA_PAGES, sizeof(uint32_t));
+  live = calloc(LIVE_SIZE, sizeof(live_t));
+
+  kmalloc_init();
+  kmalloc_profile_set_rate(0);
+  /* The buddy allocator's own bitmaps aren't heap. */
+  unsigned base = rss;
+  rss_peak = rss;
+
+  double start = now_ns();
+  for (size_t i = 0; i < nevents; ++i)
+    replay(&events[i]);
+  double elapsed = now_ns() - start;
+
+  printf("%zu events in %.1f ms (%.0f ops/sec)\n", nevents, elapsed / 1e6,
+         nevents / (elapsed / 1e9));
+  printf("heap pages: peak %u, end %u\n", rss_peak - base, rss - base);
+  printf("requested bytes: peak %llu, end %llu (%u objects)\n",
+         live_bytes_peak, live_bytes, nlive);
+  if (live_bytes_peak)
+    printf("peak overhead: %.2fx\n",
+           (double)(rss_peak - base) * 4096 / live_bytes_peak);
+  printf("trace page allocator peak: %u pages\n", trace_pages_peak);
+  if (ndropped || nunmatched || nstale || nfailed)
+    printf("dropped %u, unmatched %u, stale %u, failed %u\n", ndropped,
+           nunmatched, nstale, nfailed);
+  return 0;
+}
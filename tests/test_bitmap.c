@@ -0,0 +1,132 @@
+/* Unit tests for the bitmap ADT.
+ *
+ * Copyright (c)2018 Ross Bamford. See LICENSE for details.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "bitmap.c"
+
+static bitmap_t bm;
+static uint8_t *storage;
+
+static void make_bitmap(int64_t max_extent, int summary) {
+  storage = malloc(bitmap_calc_size(max_extent, summary));
+  memset(storage, 0xAA, bitmap_calc_size(max_extent, summary));
+
+  if (summary)
+    bitmap_init_summary(&bm, storage, max_extent);
+  else
+    bitmap_init(&bm, storage, max_extent);
+}
+
+void tearDown() {
+  free(storage);
+  storage = NULL;
+}
+
+void test_bitmap_calc_size_is_word_multiple() {
+  TEST_ASSERT_EQUAL_INT(sizeof(bitmap_word_t), bitmap_calc_size(0, 0));
+  TEST_ASSERT_EQUAL_INT(0, bitmap_calc_size(1000, 0) % sizeof(bitmap_word_t));
+  TEST_ASSERT_EQUAL_INT(0, bitmap_calc_size(1000, 1) % sizeof(bitmap_word_t));
+  TEST_ASSERT_TRUE(bitmap_calc_size(1000, 1) > bitmap_calc_size(1000, 0));
+}
+
+void test_bitmap_init_clears_all_bits() {
+  make_bitmap(4095, 1);
+
+  TEST_ASSERT_EQUAL_INT(-1, bitmap_first_set(&bm));
+  TEST_ASSERT_EQUAL_INT(0, bitmap_first_clear(&bm));
+}
+
+void test_bitmap_set_and_clear() {
+  make_bitmap(200, 0);
+
+  bitmap_set(&bm, 77);
+  TEST_ASSERT_TRUE(bitmap_isset(&bm, 77));
+  TEST_ASSERT_FALSE(bitmap_isclear(&bm, 77));
+  TEST_ASSERT_FALSE(bitmap_isset(&bm, 76));
+  TEST_ASSERT_FALSE(bitmap_isset(&bm, 78));
+
+  bitmap_clear(&bm, 77);
+  TEST_ASSERT_FALSE(bitmap_isset(&bm, 77));
+}
+
+void test_bitmap_first_set_without_summary() {
+  make_bitmap(100000, 0);
+
+  bitmap_set(&bm, 99999);
+  TEST_ASSERT_EQUAL_INT(99999, bitmap_first_set(&bm));
+
+  bitmap_set(&bm, 65);
+  TEST_ASSERT_EQUAL_INT(65, bitmap_first_set(&bm));
+
+  bitmap_clear(&bm, 65);
+  TEST_ASSERT_EQUAL_INT(99999, bitmap_first_set(&bm));
+}
+
+void test_bitmap_first_set_with_summary() {
+  make_bitmap(100000, 1);
+
+  bitmap_set(&bm, 99999);
+  TEST_ASSERT_EQUAL_INT(99999, bitmap_first_set(&bm));
+
+  bitmap_set(&bm, 65);
+  bitmap_set(&bm, 66);
+  TEST_ASSERT_EQUAL_INT(65, bitmap_first_set(&bm));
+
+  bitmap_clear(&bm, 65);
+  TEST_ASSERT_EQUAL_INT(66, bitmap_first_set(&bm));
+
+  bitmap_clear(&bm, 66);
+  TEST_ASSERT_EQUAL_INT(99999, bitmap_first_set(&bm));
+
+  bitmap_clear(&bm, 99999);
+  TEST_ASSERT_EQUAL_INT(-1, bitmap_first_set(&bm));
+}
+
+void test_bitmap_first_set_at_max_extent() {
+  make_bitmap(64, 1);
+
+  bitmap_set(&bm, 64);
+  TEST_ASSERT_EQUAL_INT(64, bitmap_first_set(&bm));
+}
+
+void test_bitmap_next_set() {
+  make_bitmap(5000, 1);
+
+  bitmap_set(&bm, 3);
+  bitmap_set(&bm, 31);
+  bitmap_set(&bm, 32);
+  bitmap_set(&bm, 4096);
+
+  TEST_ASSERT_EQUAL_INT(3, bitmap_next_set(&bm, 0));
+  TEST_ASSERT_EQUAL_INT(3, bitmap_next_set(&bm, 3));
+  TEST_ASSERT_EQUAL_INT(31, bitmap_next_set(&bm, 4));
+  TEST_ASSERT_EQUAL_INT(32, bitmap_next_set(&bm, 32));
+  TEST_ASSERT_EQUAL_INT(4096, bitmap_next_set(&bm, 33));
+  TEST_ASSERT_EQUAL_INT(-1, bitmap_next_set(&bm, 4097));
+  TEST_ASSERT_EQUAL_INT(-1, bitmap_next_set(&bm, 5001));
+}
+
+void test_bitmap_first_clear() {
+  make_bitmap(199, 0);
+
+  for (unsigned i = 0; i < 150; ++i)
+    bitmap_set(&bm, i);
+  TEST_ASSERT_EQUAL_INT(150, bitmap_first_clear(&bm));
+
+  bitmap_clear(&bm, 7);
+  TEST_ASSERT_EQUAL_INT(7, bitmap_first_clear(&bm));
+  TEST_ASSERT_EQUAL_INT(150, bitmap_next_clear(&bm, 8));
+}
+
+void test_bitmap_first_clear_when_full() {
+  make_bitmap(127, 1);
+
+  for (unsigned i = 0; i <= 127; ++i)
+    bitmap_set(&bm, i);
+  TEST_ASSERT_EQUAL_INT(-1, bitmap_first_clear(&bm));
+}
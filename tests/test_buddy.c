@@ -0,0 +1,127 @@
+/* Unit tests for the buddy allocator.
+ *
+ * Copyright (c)2018 Ross Bamford. See LICENSE for details.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "unity.h"
+
+/* hal.h can't be built on the host - stand in the bits buddy.c needs. */
+#define _MINK_HAL_H
+typedef struct range {
+  uint64_t start;
+  uint64_t extent;
+} range_t;
+
+#include "bitmap.c"
+#include "buddy.c"
+
+#define TEST_START  0x100000ULL
+#define TEST_EXTENT 0x400000ULL   /* 4MB, 1024 pages */
+
+static buddy_t bd;
+static uint8_t storage[0x20000] __attribute__((aligned(8)));
+
+noreturn void panic(const char *msg, ...) {
+  TEST_FAIL_MESSAGE(msg);
+  for (;;);
+}
+
+void setUp() {
+  range_t r = { .start = TEST_START, .extent = TEST_EXTENT };
+  TEST_ASSERT_TRUE(buddy_calc_overhead(r) <= sizeof(storage));
+  buddy_init(&bd, storage, r, /*start_freed=*/1);
+}
+
+void test_buddy_init_frees_whole_range() {
+  unsigned order = 22 - MIN_BUDDY_SZ_LOG2;
+  TEST_ASSERT_EQUAL_INT(1, bd.nfree[order]);
+  TEST_ASSERT_EQUAL_HEX32(1U << order, bd.nonempty);
+}
+
+void test_buddy_alloc_splits_and_returns_lowest() {
+  TEST_ASSERT_EQUAL_HEX64(TEST_START, buddy_alloc(&bd, 0x1000));
+  TEST_ASSERT_EQUAL_HEX64(TEST_START + 0x1000, buddy_alloc(&bd, 0x1000));
+  TEST_ASSERT_EQUAL_HEX64(TEST_START + 0x2000, buddy_alloc(&bd, 0x2000));
+  TEST_ASSERT_EQUAL_HEX64(TEST_START + 0x4000, buddy_alloc(&bd, 0x1000));
+}
+
+void test_buddy_free_coalesces() {
+  uint64_t a = buddy_alloc(&bd, 0x1000);
+  uint64_t b = buddy_alloc(&bd, 0x1000);
+  buddy_free(&bd, a, 0x1000);
+  buddy_free(&bd, b, 0x1000);
+
+  TEST_ASSERT_EQUAL_HEX32(1U << (22 - MIN_BUDDY_SZ_LOG2), bd.nonempty);
+}
+
+void test_buddy_free_lowers_hint() {
+  uint64_t p[8];
+  for (unsigned i = 0; i < 8; ++i)
+    p[i] = buddy_alloc(&bd, 0x1000);
+
+  buddy_free(&bd, p[2], 0x1000);
+  TEST_ASSERT_EQUAL_HEX64(p[2], buddy_alloc(&bd, 0x1000));
+}
+
+void test_buddy_alloc_exhaustion() {
+  for (unsigned i = 0; i < TEST_EXTENT / 0x1000; ++i)
+    TEST_ASSERT_TRUE(buddy_alloc(&bd, 0x1000) != ~0ULL);
+
+  TEST_ASSERT_EQUAL_HEX64(~0ULL, buddy_alloc(&bd, 0x1000));
+  TEST_ASSERT_EQUAL_HEX32(0, bd.nonempty);
+}
+
+void test_buddy_alloc_too_large_for_free_blocks() {
+  buddy_alloc(&bd, 0x1000);
+  TEST_ASSERT_EQUAL_HEX64(~0ULL, buddy_alloc(&bd, TEST_EXTENT));
+  TEST_ASSERT_EQUAL_HEX64(TEST_START + TEST_EXTENT / 2,
+                          buddy_alloc(&bd, TEST_EXTENT / 2));
+}
+
+void test_buddy_alloc_aligned() {
+  buddy_alloc(&bd, 0x1000);
+
+  /* 64KB alignment - the first free 64KB-aligned page is at +64KB, and
+     the pages between are left free. */
+  TEST_ASSERT_EQUAL_HEX64(TEST_START + 0x10000,
+                          buddy_alloc_aligned(&bd, 0x1000, 16));
+  TEST_ASSERT_EQUAL_HEX64(TEST_START + 0x1000, buddy_alloc(&bd, 0x1000));
+
+  uint64_t free_before = bd.free;
+  buddy_free(&bd, TEST_START + 0x10000, 0x1000);
+  TEST_ASSERT_EQUAL_INT(free_before + 1, bd.free);
+}
+
+void test_buddy_counters() {
+  TEST_ASSERT_EQUAL_INT(TEST_EXTENT / 0x1000, bd.total);
+  TEST_ASSERT_EQUAL_INT(TEST_EXTENT / 0x1000, bd.free);
+
+  uint64_t a = buddy_alloc(&bd, 0x4000);
+  TEST_ASSERT_EQUAL_INT(TEST_EXTENT / 0x1000 - 4, bd.free);
+  TEST_ASSERT_EQUAL_INT(1, bd.nallocs);
+
+  buddy_alloc(&bd, TEST_EXTENT);
+  TEST_ASSERT_EQUAL_INT(1, bd.nfailures);
+
+  buddy_free(&bd, a, 0x4000);
+  TEST_ASSERT_EQUAL_INT(TEST_EXTENT / 0x1000, bd.free);
+  TEST_ASSERT_EQUAL_INT(1, bd.nfrees);
+  TEST_ASSERT_EQUAL_INT(TEST_EXTENT / 0x1000, bd.total);
+}
+
+void test_buddy_alloc_1gb_block() {
+  range_t r = { .start = 0, .extent = 0x40000000ULL };
+  TEST_ASSERT_TRUE(buddy_calc_overhead(r) <= sizeof(storage));
+  buddy_init(&bd, storage, r, /*start_freed=*/1);
+
+  TEST_ASSERT_EQUAL_INT(1, bd.nfree[NUM_BUDDY_BUCKETS-1]);
+  TEST_ASSERT_EQUAL_HEX64(0, buddy_alloc(&bd, 0x40000000));
+  TEST_ASSERT_EQUAL_HEX64(~0ULL, buddy_alloc(&bd, 0x1000));
+
+  buddy_free(&bd, 0, 0x40000000);
+  TEST_ASSERT_EQUAL_INT(1, bd.nfree[NUM_BUDDY_BUCKETS-1]);
+  TEST_ASSERT_EQUAL_HEX64(0, buddy_alloc(&bd, 0x2000));
+}
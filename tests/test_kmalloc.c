@@ -0,0 +1,490 @@
+/* Unit tests for kmalloc.
+ *
+ * Copyright (c)2018 Ross Bamford. See LICENSE for details.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "unity.h"
+#include "hal_stub.h"
+
+#include "elf.h"
+/* Stacks are made up from fake_pcs, unless stack_top is set, in which
+   case the frame pointer chain is walked as arch/x86/hal.c does - as far
+   as the frame at stack_top, as the host's outer frames may not keep
+   the chain. */
+static uintptr_t fake_pcs[4];
+static uintptr_t *stack_top;
+static __attribute__((noinline))
+unsigned get_stack_trace(uintptr_t *pcs, unsigned max, unsigned skip) {
+  if (!stack_top) {
+    memcpy(pcs, fake_pcs, sizeof(fake_pcs));
+    return max;
+  }
+
+  uintptr_t *fp = __builtin_frame_address(0);
+  unsigned n = 0;
+  while (fp && fp <= stack_top && n < max) {
+    if (skip)
+      --skip;
+    else
+      pcs[n++] = fp[1];
+    fp = (uintptr_t*)fp[0];
+  }
+  return n;
+}
+static elf_t *get_kernel_elf() { return NULL; }
+static unsigned nprintks;
+static void printk(const char *fmt, ...) { ++nprintks; }
+
+#define MMAP_KERNEL_VMSPACE_START 0x40000000UL
+#define MMAP_KERNEL_VMSPACE_END   0x48000000UL
+
+#include "slab.c"
+#include "kmalloc.c"
+
+void panic(const char *msg, ...) {
+  TEST_FAIL_MESSAGE(msg);
+  abort();
+}
+
+/* vmspace stand-ins that hand out naturally aligned power-of-two blocks
+   from an arena, as the buddy allocator would, and count the pages backed
+   by physical memory. Freed blocks are not reused. */
+#define ARENA_BASE MMAP_KERNEL_VMSPACE_START
+#define ARENA_SIZE (MMAP_KERNEL_VMSPACE_END - MMAP_KERNEL_VMSPACE_START)
+static uintptr_t arena_next;
+static unsigned nmapped, phys_limit = ~0U;
+static int last_req;
+
+int vmspace_init(vmspace_t *vms, uintptr_t addr, uintptr_t sz) {
+  if (arena_next == 0) {
+    void *p = mmap((void*)ARENA_BASE, ARENA_SIZE, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+    TEST_ASSERT_EQUAL_PTR((void*)ARENA_BASE, p);
+    arena_next = ARENA_BASE;
+  }
+  return 0;
+}
+
+uintptr_t vmspace_alloc(vmspace_t *vms, unsigned sz, int alloc_phys, int req) {
+  unsigned p2 = 1U << log2_roundup(sz);
+  uintptr_t addr = (arena_next + p2 - 1) & ~((uintptr_t)p2 - 1);
+  if (addr + p2 > ARENA_BASE + ARENA_SIZE)
+    return (uintptr_t)~0ULL;
+  arena_next = addr + p2;
+  if (alloc_phys)
+    nmapped += sz >> 12;
+  return addr;
+}
+
+void vmspace_free(vmspace_t *vms, unsigned sz, uintptr_t addr, int free_phys) {
+  if (free_phys)
+    nmapped -= sz >> 12;
+}
+
+int vmspace_map(vmspace_t *vms, uintptr_t addr, unsigned sz, unsigned flags,
+                int req) {
+  if (nmapped + (sz >> 12) > phys_limit)
+    return -1;
+  last_req = req;
+  nmapped += sz >> 12;
+  return 0;
+}
+
+void vmspace_unmap(vmspace_t *vms, uintptr_t addr, unsigned sz) {
+  nmapped -= sz >> 12;
+}
+
+unsigned log2_roundup(unsigned n) {
+  unsigned l = 0;
+  while ((1U << l) < n)
+    ++l;
+  return l;
+}
+
+const char *elf_lookup_symbol(uint32_t addr, elf_t *elf) {
+  return NULL;
+}
+
+void setUp() {
+  static int initialised;
+  if (!initialised) {
+    TEST_ASSERT_EQUAL_INT(1, kmalloc_init());
+    initialised = 1;
+  }
+  kmalloc_profile_set_rate(0);
+  stack_top = NULL;
+}
+
+void tearDown() {
+  TEST_ASSERT_EQUAL_INT(1, interrupts);
+}
+
+void test_kmalloc_uses_smallest_fitting_class() {
+  TEST_ASSERT_EQUAL_INT(8, class_sizes[size_class(1)]);
+  TEST_ASSERT_EQUAL_INT(64, class_sizes[size_class(64)]);
+  TEST_ASSERT_EQUAL_INT(80, class_sizes[size_class(65)]);
+  TEST_ASSERT_EQUAL_INT(640, class_sizes[size_class(513)]);
+  TEST_ASSERT_EQUAL_INT(4096, class_sizes[size_class(4096)]);
+
+  for (unsigned sz = 1; sz <= KMALLOC_MAX_CLASS; ++sz) {
+    unsigned cls = size_class(sz);
+    TEST_ASSERT_TRUE(class_sizes[cls] >= sz);
+    TEST_ASSERT_TRUE(cls == 0 || class_sizes[cls - 1] < sz);
+  }
+}
+
+void test_kmalloc_small_objects_have_no_header() {
+  void *p = kmalloc(64);
+  TEST_ASSERT_EQUAL_PTR(&caches[size_class(64)], slab_cache_for(p));
+  TEST_ASSERT_EQUAL_INT(64, slab_cache_for(p)->size);
+
+  kfree(p);
+  TEST_ASSERT_EQUAL_PTR(p, kmalloc(64));
+  kfree(p);
+  kfree(NULL);
+}
+
+void test_kmalloc_large_objects_use_exact_pages() {
+  /* Make sure there's a chunk, so its header isn't counted. */
+  kfree(kmalloc(8192));
+
+  unsigned before = nmapped;
+  char *p = kmalloc(20 * 1024);
+  TEST_ASSERT_NULL(slab_cache_for(p));
+  TEST_ASSERT_EQUAL_INT(0, (uintptr_t)p & 0xFFF);
+  TEST_ASSERT_EQUAL_INT(5, nmapped - before);
+
+  kfree(p);
+  TEST_ASSERT_EQUAL_INT(before, nmapped);
+}
+
+void test_kmalloc_large_runs_split_and_coalesce() {
+  char *a = kmalloc(3 * 4096), *b = kmalloc(2 * 4096), *c = kmalloc(4097);
+  TEST_ASSERT_EQUAL_PTR(a + 3 * 4096, b);
+  TEST_ASSERT_EQUAL_PTR(b + 2 * 4096, c);
+
+  /* A and B merge into a five page run that fits in front of C. */
+  kfree(a);
+  kfree(b);
+  TEST_ASSERT_EQUAL_PTR(a, kmalloc(5 * 4096));
+
+  /* Freeing C merges with what follows it as well. */
+  kfree(c);
+  kfree(a);
+  chunk_t *ch = CHUNK_FOR_PTR(a);
+  TEST_ASSERT_EQUAL_INT(CHUNK_PAGES - 1, ch->nfree);
+  TEST_ASSERT_EQUAL_INT(CHUNK_PAGES - 1, ch->map[1]);
+}
+
+void test_kmalloc_returns_empty_chunks() {
+  char *a = kmalloc(CHUNK_SIZE / 2), *b = kmalloc(CHUNK_SIZE / 2);
+  TEST_ASSERT_TRUE(CHUNK_FOR_PTR(a) != CHUNK_FOR_PTR(b));
+  TEST_ASSERT_NOT_NULL(chunks->next);
+
+  kfree(a);
+  kfree(b);
+  TEST_ASSERT_NOT_NULL(chunks);
+  TEST_ASSERT_NULL(chunks->next);
+}
+
+void test_kmalloc_huge_objects_get_their_own_region() {
+  unsigned before = nmapped;
+  char *p = kmalloc(CHUNK_SIZE);
+  chunk_t *c = CHUNK_FOR_PTR(p);
+  TEST_ASSERT_EQUAL_PTR((char*)c + 4096, p);
+  TEST_ASSERT_EQUAL_INT(CHUNK_PAGES, c->npages);
+  TEST_ASSERT_EQUAL_INT(CHUNK_PAGES + 1, nmapped - before);
+
+  kfree(p);
+  TEST_ASSERT_EQUAL_INT(before, nmapped);
+}
+
+void test_krealloc_keeps_small_objects_in_their_class() {
+  char *p = kmalloc(70);
+  strcpy(p, "mink");
+  TEST_ASSERT_EQUAL_PTR(p, krealloc(p, 80));
+
+  char *q = krealloc(p, 200);
+  TEST_ASSERT_TRUE(p != q);
+  TEST_ASSERT_EQUAL_STRING("mink", q);
+  TEST_ASSERT_EQUAL_INT(224, slab_cache_for(q)->size);
+
+  kfree(q);
+  TEST_ASSERT_NULL(krealloc(kmalloc(8), 0));
+}
+
+void test_krealloc_grows_and_shrinks_runs_in_place() {
+  char *a = kmalloc(2 * 4096);
+  strcpy(a, "mink");
+
+  TEST_ASSERT_EQUAL_PTR(a, krealloc(a, 6 * 4096));
+  char *b = kmalloc(2 * 4096);
+  TEST_ASSERT_EQUAL_PTR(a + 6 * 4096, b);
+
+  /* Shrinking gives the tail back... */
+  TEST_ASSERT_EQUAL_PTR(a, krealloc(a, 3 * 4096));
+  TEST_ASSERT_EQUAL_INT(3 * 4096, large_size(a));
+
+  /* ...but growing past B has to move. */
+  char *c = krealloc(a, 8 * 4096);
+  TEST_ASSERT_TRUE(a != c);
+  TEST_ASSERT_EQUAL_STRING("mink", c);
+
+  kfree(b);
+  kfree(c);
+}
+
+void test_krealloc_grows_huge_objects_within_their_reservation() {
+  unsigned before = nmapped;
+  char *p = kmalloc(CHUNK_SIZE);
+  chunk_t *c = CHUNK_FOR_PTR(p);
+
+  TEST_ASSERT_EQUAL_PTR(p, krealloc(p, CHUNK_SIZE + 4096));
+  TEST_ASSERT_EQUAL_INT(CHUNK_PAGES + 2, nmapped - before);
+  TEST_ASSERT_EQUAL_PTR(p, krealloc(p, c->reserved - 4096));
+
+  /* The header page means the whole reservation isn't usable. */
+  char *q = krealloc(p, c->reserved);
+  TEST_ASSERT_TRUE(p != q);
+
+  kfree(q);
+  TEST_ASSERT_EQUAL_INT(before, nmapped);
+}
+
+void test_kcalloc_zeroes_and_checks_overflow() {
+  unsigned char *p = kmalloc(100);
+  memset(p, 0xFF, 100);
+  kfree(p);
+
+  unsigned char *q = kcalloc(25, 4);
+  for (unsigned i = 0; i < 100; ++i)
+    TEST_ASSERT_EQUAL_INT(0, q[i]);
+  kfree(q);
+
+  TEST_ASSERT_NULL(kcalloc(0x10000, 0x10001));
+}
+
+void test_kmalloc_aligned_honours_alignment() {
+  void *p = kmalloc_aligned(80, 64);
+  TEST_ASSERT_EQUAL_INT(0, (uintptr_t)p & 63);
+  TEST_ASSERT_EQUAL_INT(128, slab_cache_for(p)->size);
+  kfree(p);
+
+  void *q = kmalloc_aligned(100, 4096);
+  TEST_ASSERT_EQUAL_INT(0, (uintptr_t)q & 4095);
+  void *r = kmalloc_aligned(3 * 4096, 16 * 4096);
+  TEST_ASSERT_EQUAL_INT(0, (uintptr_t)r & 0xFFFF);
+
+  kfree(q);
+  kfree(r);
+}
+
+void test_kmalloc_aligned_rejects_runs_no_chunk_can_hold() {
+  uintptr_t next = arena_next;
+  unsigned mapped = nmapped;
+  TEST_ASSERT_NULL(kmalloc_aligned(4096, CHUNK_SIZE));
+  TEST_ASSERT_NULL(kmalloc_aligned(600 * 4096, CHUNK_SIZE / 2));
+  /* No chunk was made for them. */
+  TEST_ASSERT_EQUAL_HEX32(next, arena_next);
+  TEST_ASSERT_EQUAL_INT(mapped, nmapped);
+
+  void *p = kmalloc_aligned(500 * 4096, CHUNK_SIZE / 2);
+  TEST_ASSERT_EQUAL_INT(0, (uintptr_t)p & (CHUNK_SIZE / 2 - 1));
+  kfree(p);
+}
+
+void test_kmalloc_flags_zero_memory() {
+  unsigned char *p = kmalloc(100);
+  memset(p, 0xFF, 100);
+  kfree(p);
+
+  unsigned char *q = kmalloc_flags(100, KM_ZERO);
+  TEST_ASSERT_EQUAL_PTR(p, q);
+  for (unsigned i = 0; i < 100; ++i)
+    TEST_ASSERT_EQUAL_INT(0, q[i]);
+  kfree(q);
+
+  /* Large allocations ask the PMM for zeroed pages instead. */
+  kfree(kmalloc_flags(5 * 4096, KM_ZERO));
+  TEST_ASSERT_EQUAL_HEX32(PAGE_REQ_ZERO, last_req);
+}
+
+void test_kmalloc_flags_under4gb_takes_low_pages() {
+  void *p = kmalloc_flags(64, KM_UNDER4GB);
+  TEST_ASSERT_NULL(slab_cache_for(p));
+  TEST_ASSERT_EQUAL_HEX32(PAGE_REQ_UNDER4GB, last_req);
+  kfree(p);
+}
+
+void test_krealloc_keeps_under4gb_memory_low() {
+  /* In place, within a run and within a region of its own. */
+  char *p = kmalloc_flags(2 * 4096, KM_UNDER4GB);
+  last_req = -1;
+  TEST_ASSERT_EQUAL_PTR(p, krealloc(p, 3 * 4096));
+  TEST_ASSERT_EQUAL_HEX32(PAGE_REQ_UNDER4GB, last_req);
+  kfree(p);
+
+  p = kmalloc_flags(CHUNK_SIZE, KM_UNDER4GB);
+  last_req = -1;
+  TEST_ASSERT_EQUAL_PTR(p, krealloc(p, CHUNK_SIZE + 4096));
+  TEST_ASSERT_EQUAL_HEX32(PAGE_REQ_UNDER4GB, last_req);
+  kfree(p);
+
+  /* And when it has to move - here, out of its chunk. */
+  p = kmalloc_flags(2 * 4096, KM_UNDER4GB);
+  last_req = -1;
+  char *q = krealloc(p, CHUNK_SIZE);
+  TEST_ASSERT_NOT_EQUAL(p, q);
+  TEST_ASSERT_EQUAL_HEX32(PAGE_REQ_UNDER4GB, last_req);
+  kfree(q);
+}
+
+void test_kmalloc_flags_atomic_does_not_grow_or_spin() {
+  /* Nothing has used this class yet, so it has no slabs. */
+  TEST_ASSERT_NULL(kmalloc_flags(3500, KM_ATOMIC));
+  void *p = kmalloc(3500);
+  kfree(p);
+  TEST_ASSERT_EQUAL_PTR(p, kmalloc_flags(3500, KM_ATOMIC));
+  kfree(p);
+
+  /* Large allocations would have to map pages, so they never succeed,
+     even with a chunk to hand. */
+  kfree(kmalloc(3 * 4096));
+  unsigned before = nmapped;
+  TEST_ASSERT_NULL(kmalloc_flags(3 * 4096, KM_ATOMIC));
+  TEST_ASSERT_NULL(kmalloc_flags(64, KM_ATOMIC|KM_UNDER4GB));
+  TEST_ASSERT_EQUAL_INT(before, nmapped);
+}
+
+void test_kmalloc_large_gives_run_back_when_out_of_memory() {
+  kfree(kmalloc(8192));
+  chunk_t *c = chunks;
+  unsigned nfree = c->nfree;
+
+  phys_limit = nmapped + 2;
+  TEST_ASSERT_NULL(kmalloc(3 * 4096));
+  phys_limit = ~0U;
+  TEST_ASSERT_EQUAL_INT(nfree, c->nfree);
+}
+
+void test_kmalloc_profile_charges_call_sites() {
+  void *p[200];
+  kmalloc_profile_set_rate(4096);
+  fake_pcs[0] = 0x1234;
+
+  for (unsigned i = 0; i < 200; ++i)
+    p[i] = kmalloc(64);
+
+  /* 12800 bytes at one sample per 2048-6144 bytes. */
+  kprof_site_t *s = &kprof_sites[0];
+  TEST_ASSERT_EQUAL_HEX32(0x1234, s->pcs[0]);
+  TEST_ASSERT_TRUE(s->nsamples >= 2 && s->nsamples <= 7);
+  TEST_ASSERT_EQUAL_INT(s->nsamples * 4096, s->live);
+
+  /* Large allocations are always sampled, at their own size. */
+  fake_pcs[0] = 0x5678;
+  void *q = kmalloc(5 * 4096);
+  TEST_ASSERT_EQUAL_HEX32(0x5678, kprof_sites[1].pcs[0]);
+  TEST_ASSERT_EQUAL_INT(5 * 4096, kprof_sites[1].live);
+
+  nprintks = 0;
+  kmalloc_profile_dump();
+  TEST_ASSERT_EQUAL_INT(5, nprintks);
+
+  for (unsigned i = 0; i < 200; ++i)
+    kfree(p[i]);
+  kfree(q);
+  TEST_ASSERT_EQUAL_INT(0, s->live);
+  TEST_ASSERT_EQUAL_INT(0, kprof_sites[1].live);
+  TEST_ASSERT_EQUAL_INT(0, kprof_nsamples);
+}
+
+void test_kmalloc_profile_forgets_samples_in_any_order() {
+  void *p[200];
+  kmalloc_profile_set_rate(1);
+  fake_pcs[0] = 0x9abc;
+
+  for (unsigned i = 0; i < 200; ++i)
+    p[i] = kmalloc(16);
+  TEST_ASSERT_EQUAL_INT(200, kprof_nsamples);
+
+  for (unsigned i = 0; i < 200; i += 2)
+    kfree(p[i]);
+  for (unsigned i = 199; i < 200; i -= 2)
+    kfree(p[i]);
+  TEST_ASSERT_EQUAL_INT(0, kprof_nsamples);
+  TEST_ASSERT_EQUAL_INT(0, kprof_site_locked(fake_pcs)->live);
+}
+
+void test_kmalloc_profile_unsampled_frees_skip_the_lock() {
+  kmalloc_profile_set_rate(1);
+  void *p = kmalloc(32);
+  kmalloc_profile_set_rate(0);
+  void *q = kmalloc(32);
+  TEST_ASSERT_EQUAL_INT(1, kprof_nsamples);
+  TEST_ASSERT_EQUAL_INT(1, kprof_marks[KPROF_MARK(p)]);
+  TEST_ASSERT_EQUAL_INT(0, kprof_marks[KPROF_MARK(q)]);
+
+  /* The stub lock asserts if taken twice, so this would fail if q's free
+     went near it. */
+  spinlock_acquire(&kprof_lock);
+  kfree(q);
+  spinlock_release(&kprof_lock);
+
+  kfree(p);
+  TEST_ASSERT_EQUAL_INT(0, kprof_nsamples);
+  TEST_ASSERT_EQUAL_INT(0, kprof_marks[KPROF_MARK(p)]);
+}
+
+/* The site charged for the sampled allocation at 'p'. */
+static kprof_site_t *site_of(void *p) {
+  for (unsigned i = 0; i < KPROF_SAMPLES; ++i)
+    if (kprof_samples[i].ptr == p)
+      return kprof_samples[i].site;
+  TEST_FAIL_MESSAGE("Allocation wasn't sampled!");
+  return NULL;
+}
+
+static uintptr_t alloc_here_ret;
+
+/* Allocate through entry point 'how', noting where we were called from. */
+static __attribute__((noinline)) void *alloc_here(unsigned how, void *old) {
+  alloc_here_ret = (uintptr_t)__builtin_return_address(0);
+  switch (how) {
+  case 0: return kmalloc(64);
+  case 1: return kmalloc_flags(64, KM_ZERO);
+  case 2: return kcalloc(4, 16);
+  case 3: return krealloc(NULL, 64);
+  case 4: return krealloc(old, 1000);
+  default: return kmalloc_aligned(64, 64);
+  }
+}
+
+void test_kmalloc_profile_skips_only_allocator_frames() {
+  stack_top = __builtin_frame_address(0);
+  kmalloc_profile_set_rate(1);
+
+  void *old = kmalloc(16);
+  for (unsigned how = 0; how <= 5; ++how) {
+    void *p = alloc_here(how, old);
+    kprof_site_t *s = site_of(p);
+
+    /* The first frame recorded is the entry point's caller, so the next
+       is its caller in turn. */
+    uintptr_t start = (uintptr_t)&alloc_here;
+    TEST_ASSERT_TRUE(s->pcs[0] > start && s->pcs[0] - start < 0x1000);
+    TEST_ASSERT_EQUAL_HEX64(alloc_here_ret, s->pcs[1]);
+
+    if (how == 4)
+      old = NULL;
+    kfree(p);
+  }
+  kfree(old);
+  TEST_ASSERT_EQUAL_INT(0, kprof_nsamples);
+}
@@ -0,0 +1,124 @@
+/* Unit tests for the physical memory manager's contiguous allocations.
+ *
+ * Copyright (c)2018 Ross Bamford. See LICENSE for details.
+ */
+
+#define _DEFAULT_SOURCE
+#define MINK_ASSERTIONS
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "unity.h"
+#include "hal_stub.h"
+
+#define PAGE_REQ_UNDER1MB 1
+
+/* The rest of hal.h's page allocator interface, which pmm.c defines. */
+uint64_t alloc_page(int req);
+int free_page(uint64_t page);
+uint64_t alloc_pages(int req, size_t num);
+int free_pages(uint64_t pages, size_t num);
+uint64_t alloc_pages_aligned(int req, size_t num, unsigned align_log2);
+int alloc_pages_bulk(int req, size_t num, uint64_t *pages);
+int free_pages_bulk(uint64_t *pages, size_t num);
+int init_physical_memory_early(range_t *ranges, unsigned nranges,
+                               uint64_t max_extent);
+int init_physical_memory();
+
+static int get_num_cpucores() { return 1; }
+static void zero_physical_page(uint64_t p) {}
+static void printk(const char *fmt, ...) {}
+
+/* The PMM's bitmaps live at a fixed address; map() only has to say yes. */
+#define MMAP_PMM_BITMAP     0x70000000UL
+#define MMAP_PMM_BITMAP_END 0x70400000UL
+static int map(uintptr_t v, uint64_t p, int num_pages, unsigned flags) {
+  return 0;
+}
+
+#include "bitmap.c"
+#include "buddy.c"
+#include "pmm.c"
+
+void panic(const char *msg, ...) {
+  TEST_FAIL_MESSAGE(msg);
+  abort();
+}
+
+/* 64MB below 4GB, with the first megabyte. */
+#define RAM_END 0x4000000ULL
+
+void setUp() {
+  static int initialised;
+  if (!initialised) {
+    void *p = mmap((void*)MMAP_PMM_BITMAP,
+                   MMAP_PMM_BITMAP_END - MMAP_PMM_BITMAP,
+                   PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+    TEST_ASSERT_EQUAL_PTR((void*)MMAP_PMM_BITMAP, p);
+
+    range_t r[2] = {{0x1000, 0x9e000}, {0x100000, RAM_END - 0x100000}};
+    TEST_ASSERT_EQUAL_INT(0, init_physical_memory_early(r, 2, RAM_END));
+    TEST_ASSERT_EQUAL_INT(0, init_physical_memory());
+    initialised = 1;
+  }
+}
+
+void tearDown() {
+  TEST_ASSERT_EQUAL_INT(1, interrupts);
+}
+
+void test_pmm_reserves_contiguous_region_at_top_of_low_memory() {
+  TEST_ASSERT_EQUAL_HEX64(CMA_SIZE, cma.size);
+  TEST_ASSERT_EQUAL_HEX64(RAM_END - CMA_SIZE, cma.start);
+  TEST_ASSERT_EQUAL_INT(CMA_SIZE >> 12, cma.allocator.free);
+
+  /* Ordinary allocations never come from it. */
+  uint64_t p = alloc_pages(PAGE_REQ_NONE, 4);
+  TEST_ASSERT_FALSE(in_cma(p));
+  free_pages(p, 4);
+}
+
+void test_pmm_aligned_request_uses_region_when_zones_are_fragmented() {
+  /* Take every page the general zones have, then give back every other
+     one, so that no two free pages are adjacent. */
+  static uint64_t pages[RAM_END >> 12];
+  unsigned n = 0;
+  uint64_t p;
+  while ((p = alloc_page(PAGE_REQ_NONE|PAGE_REQ_RESERVE)) != ~0ULL)
+    pages[n++] = p;
+  TEST_ASSERT_TRUE(n > 1000);
+  for (unsigned i = 0; i < n; ++i)
+    TEST_ASSERT_FALSE(in_cma(pages[i]));
+
+  unsigned nfreed = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    if ((pages[i] >> 12) & 1) {
+      free_page(pages[i]);
+      pages[i] = ~0ULL;
+      ++nfreed;
+    }
+  }
+  TEST_ASSERT_TRUE(nfreed > 500);
+
+  /* Plenty of memory is free, but none of it is contiguous. */
+  TEST_ASSERT_EQUAL_HEX64(~0ULL, alloc_pages(PAGE_REQ_NONE, 2));
+
+  uint64_t a = alloc_pages_aligned(PAGE_REQ_NONE, 16, 16);
+  TEST_ASSERT_NOT_EQUAL(~0ULL, a);
+  TEST_ASSERT_TRUE(in_cma(a) && in_cma(a + 15 * 0x1000));
+  TEST_ASSERT_EQUAL_HEX64(0, a & 0xFFFF);
+  TEST_ASSERT_EQUAL_INT((CMA_SIZE >> 12) - 16, cma.allocator.free);
+
+  /* Below 1MB is outside the region. */
+  TEST_ASSERT_EQUAL_HEX64(~0ULL, alloc_pages_aligned(PAGE_REQ_UNDER1MB,
+                                                     512, 21));
+
+  free_pages(a, 16);
+  TEST_ASSERT_EQUAL_INT(CMA_SIZE >> 12, cma.allocator.free);
+  for (unsigned i = 0; i < n; ++i)
+    if (pages[i] != ~0ULL)
+      free_page(pages[i]);
+}
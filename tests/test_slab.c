@@ -0,0 +1,422 @@
+/* Unit tests for the slab allocator.
+ *
+ * Copyright (c)2018 Ross Bamford. See LICENSE for details.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "unity.h"
+#include "hal_stub.h"
+
+#include "slab.c"
+
+void panic(const char *msg, ...) {
+  TEST_FAIL_MESSAGE(msg);
+  abort();
+}
+
+/* vmspace stand-ins that hand out naturally aligned blocks from an arena
+   below 4GB (as the off-slab descriptor table expects), and count what is
+   outstanding. Freed blocks are not reused. */
+#define ARENA_BASE 0x40000000UL
+#define ARENA_SIZE 0x4000000UL
+static uintptr_t arena_next;
+static unsigned nslabs;
+
+uintptr_t vmspace_alloc(vmspace_t *vms, unsigned sz, int alloc_phys, int req) {
+  if (arena_next == 0) {
+    void *p = mmap((void*)ARENA_BASE, ARENA_SIZE, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+    TEST_ASSERT_EQUAL_PTR((void*)ARENA_BASE, p);
+    arena_next = ARENA_BASE;
+  }
+  uintptr_t addr = (arena_next + sz - 1) & ~((uintptr_t)sz - 1);
+  TEST_ASSERT_TRUE(addr + sz <= ARENA_BASE + ARENA_SIZE);
+  arena_next = addr + sz;
+  ++nslabs;
+  return addr;
+}
+
+void vmspace_free(vmspace_t *vms, unsigned sz, uintptr_t addr, int free_phys) {
+  --nslabs;
+  memset((void*)addr, 0xAA, sz);
+}
+
+/* Number of off-slab descriptor tables - these are never freed. */
+static unsigned desc_tables() {
+  unsigned n = 0;
+  for (unsigned i = 0; i < DESC_DIR_ENTRIES; ++i)
+    n += desc_dir[i] != NULL;
+  return n;
+}
+
+/* Number of slabs outstanding. */
+static unsigned slabs() {
+  return nslabs - desc_tables();
+}
+
+static slab_cache_t c;
+
+void setUp() {
+  nslabs = desc_tables();
+  TEST_ASSERT_EQUAL_INT(0, slab_cache_create(&c, NULL, 64, NULL, NULL));
+  /* Most tests look at the slab layer directly. */
+  slab_cache_set_magazine_size(&c, 0);
+}
+
+void tearDown() {
+  slab_cache_destroy(&c);
+  slab_cache_destroy(&mag_cache);
+  slab_cache_destroy(&desc_cache);
+  TEST_ASSERT_EQUAL_INT(0, slabs());
+  TEST_ASSERT_EQUAL_INT(1, interrupts);
+}
+
+void test_slab_alloc_returns_distinct_objects_in_one_slab() {
+  char *a = slab_cache_alloc(&c);
+  char *b = slab_cache_alloc(&c);
+
+  TEST_ASSERT_EQUAL_INT(1, slabs());
+  TEST_ASSERT_EQUAL_PTR(a + 64, b);
+  TEST_ASSERT_EQUAL_PTR(FOOTER_FOR_PTR(&c, a), c.partial);
+  TEST_ASSERT_EQUAL_INT(2, c.partial->inuse);
+}
+
+void test_slab_free_reuses_object() {
+  void *a = slab_cache_alloc(&c);
+  slab_cache_alloc(&c);
+  slab_cache_free(&c, a);
+
+  TEST_ASSERT_EQUAL_PTR(a, slab_cache_alloc(&c));
+}
+
+void test_slab_full_slab_moves_to_full_list() {
+  void *objs[256];
+  for (unsigned i = 0; i < c.nobjs; ++i)
+    objs[i] = slab_cache_alloc(&c);
+
+  TEST_ASSERT_NULL(c.partial);
+  TEST_ASSERT_EQUAL_PTR(FOOTER_FOR_PTR(&c, objs[0]), c.full);
+
+  /* The next allocation needs a new slab. */
+  void *extra = slab_cache_alloc(&c);
+  TEST_ASSERT_EQUAL_INT(2, slabs());
+  TEST_ASSERT_EQUAL_PTR(FOOTER_FOR_PTR(&c, extra), c.partial);
+
+  slab_cache_free(&c, objs[3]);
+  TEST_ASSERT_NULL(c.full);
+  TEST_ASSERT_EQUAL_PTR(objs[3], slab_cache_alloc(&c));
+}
+
+void test_slab_keeps_empty_slabs() {
+  void *objs[512];
+  slab_cache_set_empty_max(&c, 1);
+  for (unsigned i = 0; i < c.nobjs * 2; ++i)
+    objs[i] = slab_cache_alloc(&c);
+  TEST_ASSERT_EQUAL_INT(2, slabs());
+
+  for (unsigned i = 0; i < c.nobjs * 2; ++i)
+    slab_cache_free(&c, objs[i]);
+
+  TEST_ASSERT_EQUAL_INT(1, slabs());
+  TEST_ASSERT_EQUAL_INT(1, c.nempty);
+  TEST_ASSERT_NOT_NULL(c.empty);
+  TEST_ASSERT_NULL(c.partial);
+  TEST_ASSERT_NULL(c.full);
+
+  /* The empty slab is reused rather than creating a new one. */
+  slab_cache_alloc(&c);
+  TEST_ASSERT_EQUAL_INT(1, slabs());
+  TEST_ASSERT_NULL(c.empty);
+}
+
+void test_slab_reaper_releases_idle_slabs() {
+  void *a = slab_cache_alloc(&c);
+  jiffies = 1000;
+  slab_cache_free(&c, a);
+  TEST_ASSERT_EQUAL_INT(1, slabs());
+
+  /* Not idle for long enough yet. */
+  jiffies += SLAB_REAP_IDLE - 1;
+  slab_reap();
+  TEST_ASSERT_EQUAL_INT(1, slabs());
+
+  jiffies += 1;
+  slab_reap();
+  TEST_ASSERT_EQUAL_INT(0, slabs());
+  TEST_ASSERT_NULL(c.empty);
+  TEST_ASSERT_EQUAL_INT(0, c.nempty);
+}
+
+void test_slab_set_empty_max_trims_empty_slabs() {
+  void *objs[512];
+  for (unsigned i = 0; i < c.nobjs * 3; ++i)
+    objs[i] = slab_cache_alloc(&c);
+  for (unsigned i = 0; i < c.nobjs * 3; ++i)
+    slab_cache_free(&c, objs[i]);
+  TEST_ASSERT_EQUAL_INT(SLAB_EMPTY_DEFAULT, c.nempty);
+
+  slab_cache_set_empty_max(&c, 0);
+  TEST_ASSERT_EQUAL_INT(0, c.nempty);
+  TEST_ASSERT_EQUAL_INT(0, slabs());
+}
+
+void test_slab_colours_successive_slabs() {
+  /* Four 960-byte objects leave slack for a few colours. */
+  slab_cache_destroy(&c);
+  slab_cache_create(&c, NULL, 960, NULL, NULL);
+  slab_cache_set_magazine_size(&c, 0);
+  TEST_ASSERT_EQUAL_INT(0x1000, c.slab_size);
+  TEST_ASSERT_EQUAL_INT(4, c.nobjs);
+  TEST_ASSERT_TRUE(c.colour_max >= SLAB_COLOUR_ALIGN);
+
+  uintptr_t offs[4];
+  for (unsigned i = 0; i < 4; ++i) {
+    for (unsigned j = 0; j < c.nobjs - 1; ++j)
+      slab_cache_alloc(&c);
+    offs[i] = (uintptr_t)slab_cache_alloc(&c) & (c.slab_size - 1);
+  }
+
+  for (unsigned i = 0; i < 4; ++i) {
+    unsigned colour = (i * SLAB_COLOUR_ALIGN) % (c.colour_max + SLAB_COLOUR_ALIGN);
+    TEST_ASSERT_EQUAL_INT(colour + 3 * 960, offs[i]);
+  }
+}
+
+void test_slab_size_limits_waste() {
+  /* One 3000-byte object would waste a quarter of a 4KB slab, but five fit
+     snugly in 16KB. */
+  slab_cache_destroy(&c);
+  slab_cache_create(&c, NULL, 3000, NULL, NULL);
+  TEST_ASSERT_EQUAL_INT(0x4000, c.slab_size);
+  TEST_ASSERT_EQUAL_INT(5, c.nobjs);
+
+  void *a = slab_cache_alloc(&c);
+  TEST_ASSERT_EQUAL_INT(1, slab_for(&c, a)->inuse);
+  slab_cache_free(&c, a);
+
+  /* Objects that can't fit in the largest slab are refused. */
+  slab_cache_destroy(&c);
+  TEST_ASSERT_EQUAL_INT(-1, slab_cache_create(&c, NULL, SLAB_MAX_SIZE + 1,
+                                              NULL, NULL));
+}
+
+void test_slab_offslab_packs_page_sized_objects() {
+  slab_cache_destroy(&c);
+  slab_cache_create(&c, NULL, 4096, NULL, NULL);
+  slab_cache_set_magazine_size(&c, 0);
+  TEST_ASSERT_TRUE(c.offslab);
+  TEST_ASSERT_EQUAL_INT(0x1000, c.slab_size);
+  TEST_ASSERT_EQUAL_INT(1, c.nobjs);
+
+  char *a = slab_cache_alloc(&c), *b = slab_cache_alloc(&c);
+  TEST_ASSERT_EQUAL_INT(0, (uintptr_t)a % 4096);
+  TEST_ASSERT_EQUAL_INT(0, (uintptr_t)b % 4096);
+  TEST_ASSERT_TRUE(slab_for(&c, a) != slab_for(&c, b));
+
+  /* The descriptor is found through the table, not the slab. */
+  slab_footer_t *f = slab_for(&c, a + 100);
+  TEST_ASSERT_EQUAL_HEX32((uintptr_t)a, f->start);
+  TEST_ASSERT_EQUAL_INT(1, f->inuse);
+  TEST_ASSERT_TRUE(f == c.full || f == c.full->next);
+
+  slab_cache_free(&c, a);
+  slab_cache_free(&c, b);
+  TEST_ASSERT_EQUAL_INT(2, c.nempty);
+}
+
+void test_slab_offslab_packs_power_of_two_objects() {
+  slab_cache_destroy(&c);
+  slab_cache_create(&c, NULL, 2048, NULL, NULL);
+  TEST_ASSERT_TRUE(c.offslab);
+  TEST_ASSERT_EQUAL_INT(2, c.nobjs);
+  TEST_ASSERT_EQUAL_INT(0x1000, c.slab_size);
+
+  /* Small caches keep their descriptors on the slab. */
+  slab_cache_destroy(&c);
+  slab_cache_create(&c, NULL, 256, NULL, NULL);
+  TEST_ASSERT_FALSE(c.offslab);
+}
+
+void test_slab_cache_for_finds_owner_from_any_page() {
+  static slab_cache_t d;
+  slab_cache_create(&d, NULL, 1500, NULL, NULL);
+  slab_cache_set_magazine_size(&d, 0);
+  TEST_ASSERT_TRUE(d.slab_size > 0x1000);
+
+  void *a = slab_cache_alloc(&c);
+  TEST_ASSERT_EQUAL_PTR(&c, slab_cache_for(a));
+
+  /* Every page of a multi-page slab maps back to its cache. */
+  slab_footer_t *f = slab_for(&d, slab_cache_alloc(&d));
+  for (uintptr_t p = f->start; p < f->start + d.slab_size; p += 0x1000)
+    TEST_ASSERT_EQUAL_PTR(&d, slab_cache_for((void*)p));
+
+  /* Memory that isn't in a slab has no owner. */
+  uintptr_t start = f->start;
+  TEST_ASSERT_NULL(slab_cache_for(&d));
+  slab_cache_destroy(&d);
+  TEST_ASSERT_NULL(slab_cache_for((void*)start));
+
+  slab_cache_free(&c, a);
+}
+
+void test_slab_atomic_alloc_does_not_grow_or_spin() {
+  TEST_ASSERT_NULL(slab_cache_alloc_flags(&c, SLAB_ATOMIC));
+  TEST_ASSERT_EQUAL_INT(0, slabs());
+
+  void *a = slab_cache_alloc(&c), *b = slab_cache_alloc_flags(&c, SLAB_ATOMIC);
+  TEST_ASSERT_NOT_NULL(b);
+
+  spinlock_acquire(&c.lock);
+  TEST_ASSERT_NULL(slab_cache_alloc_flags(&c, SLAB_ATOMIC));
+  spinlock_release(&c.lock);
+
+  slab_cache_free(&c, a);
+  slab_cache_free(&c, b);
+}
+
+void test_slab_alloc_zeroes_objects() {
+  char *a = slab_cache_alloc(&c);
+  memset(a, 0xFF, 64);
+  slab_cache_free(&c, a);
+
+  char *b = slab_cache_alloc_flags(&c, SLAB_ZERO);
+  TEST_ASSERT_EQUAL_PTR(a, b);
+  for (unsigned i = 0; i < 64; ++i)
+    TEST_ASSERT_EQUAL_INT(0, b[i]);
+  slab_cache_free(&c, b);
+}
+
+static unsigned nctors, ndtors;
+static void ctor(void *obj) { ++nctors; strcpy(obj, "mink"); }
+static void dtor(void *obj) { ++ndtors; TEST_ASSERT_EQUAL_STRING("mink", obj); }
+
+void test_slab_ctor_runs_once_per_object() {
+  slab_cache_destroy(&c);
+  nctors = ndtors = 0;
+  slab_cache_create(&c, NULL, 5, ctor, dtor);
+  slab_cache_set_magazine_size(&c, 0);
+
+  /* The freelist link lives after the object, out of the ctor's way. */
+  TEST_ASSERT_EQUAL_INT(8, c.link);
+  TEST_ASSERT_EQUAL_INT(16, c.stride);
+
+  char *a = slab_cache_alloc(&c);
+  TEST_ASSERT_EQUAL_INT(c.nobjs, nctors);
+  TEST_ASSERT_EQUAL_STRING("mink", a);
+  slab_cache_free(&c, a);
+
+  /* Freed objects keep their constructed state. */
+  TEST_ASSERT_EQUAL_PTR(a, slab_cache_alloc(&c));
+  TEST_ASSERT_EQUAL_STRING("mink", a);
+  TEST_ASSERT_EQUAL_INT(c.nobjs, nctors);
+  TEST_ASSERT_EQUAL_INT(0, ndtors);
+
+  slab_cache_destroy(&c);
+  TEST_ASSERT_EQUAL_INT(c.nobjs, ndtors);
+}
+
+void test_slab_magazine_serves_frees_and_allocs() {
+  slab_cache_set_magazine_size(&c, 4);
+
+  void *a = slab_cache_alloc(&c);
+  slab_footer_t *f = FOOTER_FOR_PTR(&c, a);
+  slab_cache_free(&c, a);
+
+  /* The object went into this CPU's magazine, not back to its slab. */
+  TEST_ASSERT_EQUAL_INT(1, f->inuse);
+  TEST_ASSERT_EQUAL_INT(1, c.cpus[0].loaded->rounds);
+  TEST_ASSERT_EQUAL_PTR(a, slab_cache_alloc(&c));
+  TEST_ASSERT_EQUAL_INT(0, c.cpus[0].loaded->rounds);
+}
+
+void test_slab_magazine_exchanges_with_depot() {
+  void *objs[12];
+  slab_cache_set_magazine_size(&c, 4);
+
+  for (unsigned i = 0; i < 12; ++i)
+    objs[i] = slab_cache_alloc(&c);
+  for (unsigned i = 0; i < 12; ++i)
+    slab_cache_free(&c, objs[i]);
+
+  /* Loaded and previous are full, and one magazine went to the depot. */
+  TEST_ASSERT_EQUAL_INT(4, c.cpus[0].loaded->rounds);
+  TEST_ASSERT_EQUAL_INT(4, c.cpus[0].prev->rounds);
+  TEST_ASSERT_NOT_NULL(c.depot_full);
+  TEST_ASSERT_NULL(c.depot_full->next);
+
+  /* Draining gives everything back to the slabs. */
+  slab_cache_drain(&c);
+  TEST_ASSERT_NULL(c.depot_full);
+  TEST_ASSERT_NULL(c.cpus[0].loaded);
+  TEST_ASSERT_NULL(c.partial);
+  TEST_ASSERT_NOT_NULL(c.empty);
+}
+
+void test_slab_magazine_depot_is_bounded() {
+  void *objs[512];
+  unsigned n = 4 * (SLAB_DEPOT_MAX + 4);
+  slab_cache_set_magazine_size(&c, 4);
+
+  for (unsigned i = 0; i < n; ++i)
+    objs[i] = slab_cache_alloc(&c);
+  for (unsigned i = 0; i < n; ++i)
+    slab_cache_free(&c, objs[i]);
+
+  /* The CPU's two magazines and a full depot hold what they can, and the
+     rest went back to the slabs. */
+  TEST_ASSERT_EQUAL_INT(SLAB_DEPOT_MAX, c.nfull);
+  unsigned held = 4 * (SLAB_DEPOT_MAX + 2), inuse = 0;
+  for (slab_footer_t *f = c.partial; f; f = f->next)
+    inuse += f->inuse;
+  for (slab_footer_t *f = c.full; f; f = f->next)
+    inuse += f->inuse;
+  TEST_ASSERT_EQUAL_INT(held, inuse);
+}
+
+void test_slab_reaper_flushes_idle_depot_magazines() {
+  void *objs[24];
+  slab_cache_set_magazine_size(&c, 4);
+
+  for (unsigned i = 0; i < 24; ++i)
+    objs[i] = slab_cache_alloc(&c);
+  slab_footer_t *f = FOOTER_FOR_PTR(&c, objs[0]);
+  jiffies = 1000;
+  for (unsigned i = 0; i < 24; ++i)
+    slab_cache_free(&c, objs[i]);
+
+  /* Two magazines on the CPU and four in the depot, so nothing has reached
+     the slab. */
+  TEST_ASSERT_EQUAL_INT(4, c.nfull);
+  TEST_ASSERT_EQUAL_INT(24, f->inuse);
+
+  jiffies += SLAB_REAP_IDLE - 1;
+  slab_reap();
+  TEST_ASSERT_EQUAL_INT(4, c.nfull);
+
+  /* The depot is flushed; the CPU's own magazines are left alone. */
+  jiffies += 1;
+  slab_reap();
+  TEST_ASSERT_EQUAL_INT(0, c.nfull);
+  TEST_ASSERT_NULL(c.depot_full);
+  TEST_ASSERT_NULL(c.depot_empty);
+  TEST_ASSERT_EQUAL_INT(8, f->inuse);
+
+  /* Once those are drained too, the slab is reaped like any other. */
+  slab_cache_drain(&c);
+  TEST_ASSERT_EQUAL_INT(1, c.nempty);
+  jiffies += SLAB_REAP_IDLE;
+  slab_reap();
+  TEST_ASSERT_EQUAL_INT(0, c.nempty);
+  TEST_ASSERT_NULL(c.empty);
+}
+
+void test_slab_magazine_size_is_bounded() {
+  TEST_ASSERT_EQUAL_INT(-1, slab_cache_set_magazine_size(&c, SLAB_MAG_MAX + 1));
+  TEST_ASSERT_EQUAL_INT(0, slab_cache_set_magazine_size(&c, SLAB_MAG_MAX));
+}
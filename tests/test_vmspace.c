@@ -0,0 +1,437 @@
+/* Unit tests for vmspace demand paging and the tree backend.
+ *
+ * Copyright (c)2018 Ross Bamford. See LICENSE for details.
+ */
+
+#define _DEFAULT_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "unity.h"
+#include "hal_stub.h"
+
+/* Page tables and the PMM: one frame number and set of flags per page of
+   the test vmspaces, and a count of pages handed out. */
+#define VMS_START  0x50000000UL
+#define VMS_SIZE   0x01000000UL
+#define TREE_START 0x51000000UL
+#define TREE_SIZE  0x00100000UL
+#define VMS_PAGES  ((TREE_START + TREE_SIZE - VMS_START) >> 12)
+
+static uint32_t frames[VMS_PAGES];
+static unsigned page_flags[VMS_PAGES];
+static unsigned nallocated, phys_limit, next_frame;
+static int last_req;
+
+static int map(uintptr_t v, uint64_t p, int num_pages, unsigned flags) {
+  for (int i = 0; i < num_pages; ++i) {
+    unsigned idx = ((v - VMS_START) >> 12) + i;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, frames[idx], "Page already mapped!");
+    frames[idx] = (uint32_t)(p >> 12) + i;
+    page_flags[idx] = flags;
+  }
+  return 0;
+}
+
+static int unmap(uintptr_t v, int num_pages) {
+  for (int i = 0; i < num_pages; ++i)
+    frames[((v - VMS_START) >> 12) + i] = 0;
+  return 0;
+}
+
+static uint64_t get_mapping(uintptr_t v, unsigned *flags) {
+  uint32_t f = frames[(v - VMS_START) >> 12];
+  return f ? (uint64_t)f << 12 : ~0ULL;
+}
+
+static int alloc_pages_bulk(int req, size_t num, uint64_t *pages) {
+  if (nallocated + num > phys_limit)
+    return -1;
+  for (size_t i = 0; i < num; ++i)
+    pages[i] = (uint64_t)next_frame++ << 12;
+  nallocated += num;
+  last_req = req;
+  return 0;
+}
+
+static int free_page(uint64_t page) {
+  --nallocated;
+  return 0;
+}
+
+static int free_pages_bulk(uint64_t *pages, size_t num) {
+  nallocated -= num;
+  return 0;
+}
+
+#include "bitmap.c"
+#include "buddy.c"
+#include "vmspace.c"
+
+void printk(const char *fmt, ...) {}
+
+noreturn void panic(const char *msg, ...) {
+  TEST_FAIL_MESSAGE(msg);
+  abort();
+}
+
+static vmspace_t vms;
+static unsigned base;   /* Pages the vmspaces use for bookkeeping. */
+
+static int is_backed(uintptr_t addr) {
+  return get_mapping(addr, NULL) != ~0ULL;
+}
+
+void setUp() {
+  static int mapped;
+  if (!mapped) {
+    void *p = mmap((void*)VMS_START, VMS_PAGES << 12, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+    TEST_ASSERT_EQUAL_PTR((void*)VMS_START, p);
+    mapped = 1;
+  }
+  memset(frames, 0, sizeof(frames));
+  all_vmspaces = NULL;
+  nallocated = 0;
+  next_frame = 1;
+  phys_limit = ~0U;
+
+  TEST_ASSERT_EQUAL_INT(0, vmspace_init(&vms, VMS_START, VMS_SIZE));
+  base = nallocated;
+}
+
+void test_vmspace_lazy_alloc_backs_nothing() {
+  vmspace_region_t r;
+  uintptr_t a = vmspace_alloc_lazy(&vms, &r, 0x10000, PAGE_WRITE, 0, 0);
+
+  TEST_ASSERT_NOT_EQUAL(~0UL, a);
+  TEST_ASSERT_EQUAL_HEX32(a, r.start);
+  TEST_ASSERT_EQUAL_UINT(base, nallocated);
+}
+
+void test_vmspace_fault_backs_touched_page() {
+  vmspace_region_t r;
+  uintptr_t a = vmspace_alloc_lazy(&vms, &r, 0x10000, PAGE_WRITE,
+                                   PAGE_REQ_ZERO, 0);
+
+  TEST_ASSERT_EQUAL_INT(0, vmspace_handle_fault(a + 0x3123, 0));
+  TEST_ASSERT_EQUAL_UINT(base + 1, nallocated);
+  TEST_ASSERT_TRUE(is_backed(a + 0x3000));
+  TEST_ASSERT_FALSE(is_backed(a + 0x2000));
+  TEST_ASSERT_FALSE(is_backed(a + 0x4000));
+  TEST_ASSERT_EQUAL_UINT(PAGE_WRITE, page_flags[(a + 0x3000 - VMS_START) >> 12]);
+  TEST_ASSERT_EQUAL_INT(PAGE_REQ_ZERO, last_req);
+}
+
+void test_vmspace_fault_prefaults_following_pages() {
+  vmspace_region_t r;
+  uintptr_t a = vmspace_alloc_lazy(&vms, &r, 0x10000, PAGE_WRITE, 0, 3);
+
+  TEST_ASSERT_EQUAL_INT(0, vmspace_handle_fault(a + 0x1000, 0));
+  TEST_ASSERT_EQUAL_UINT(base + 4, nallocated);
+  TEST_ASSERT_FALSE(is_backed(a));
+  for (unsigned i = 1; i <= 4; ++i)
+    TEST_ASSERT_TRUE(is_backed(a + i * 0x1000));
+  TEST_ASSERT_FALSE(is_backed(a + 0x5000));
+}
+
+void test_vmspace_prefault_stops_at_region_end() {
+  vmspace_region_t r;
+  uintptr_t a = vmspace_alloc_lazy(&vms, &r, 0x4000, PAGE_WRITE, 0, 16);
+
+  TEST_ASSERT_EQUAL_INT(0, vmspace_handle_fault(a + 0x2000, 0));
+  TEST_ASSERT_EQUAL_UINT(base + 2, nallocated);
+}
+
+void test_vmspace_prefault_skips_backed_pages() {
+  vmspace_region_t r;
+  uintptr_t a = vmspace_alloc_lazy(&vms, &r, 0x10000, PAGE_WRITE, 0, 3);
+
+  TEST_ASSERT_EQUAL_INT(0, vmspace_handle_fault(a + 0x2000, 0));
+  TEST_ASSERT_EQUAL_INT(0, vmspace_handle_fault(a, 0));
+  TEST_ASSERT_EQUAL_UINT(base + 6, nallocated);
+  for (unsigned i = 0; i < 6; ++i)
+    TEST_ASSERT_TRUE(is_backed(a + i * 0x1000));
+}
+
+void test_vmspace_fault_outside_lazy_region_fails() {
+  vmspace_region_t r;
+  vmspace_alloc_lazy(&vms, &r, 0x4000, PAGE_WRITE, 0, 0);
+  uintptr_t b = vmspace_alloc(&vms, 0x4000, 0, 0);
+
+  TEST_ASSERT_EQUAL_INT(-1, vmspace_handle_fault(b, 0));
+  TEST_ASSERT_EQUAL_INT(-1, vmspace_handle_fault(VMS_START + VMS_SIZE, 0));
+  TEST_ASSERT_EQUAL_UINT(base, nallocated);
+}
+
+void test_vmspace_user_fault_on_kernel_region_fails() {
+  vmspace_region_t r, u;
+  uintptr_t a = vmspace_alloc_lazy(&vms, &r, 0x4000, PAGE_WRITE, 0, 0);
+  uintptr_t b = vmspace_alloc_lazy(&vms, &u, 0x4000, PAGE_WRITE|PAGE_USER,
+                                   0, 0);
+
+  TEST_ASSERT_EQUAL_INT(-1, vmspace_handle_fault(a, 1));
+  TEST_ASSERT_EQUAL_INT(0, vmspace_handle_fault(b, 1));
+}
+
+void test_vmspace_fault_fails_when_memory_runs_out() {
+  vmspace_region_t r;
+  uintptr_t a = vmspace_alloc_lazy(&vms, &r, 0x10000, PAGE_WRITE, 0, 3);
+
+  phys_limit = nallocated;
+  TEST_ASSERT_EQUAL_INT(-1, vmspace_handle_fault(a, 0));
+  TEST_ASSERT_FALSE(is_backed(a));
+
+  /* Prefaulting is best effort. */
+  phys_limit = nallocated + 1;
+  TEST_ASSERT_EQUAL_INT(0, vmspace_handle_fault(a, 0));
+  TEST_ASSERT_TRUE(is_backed(a));
+}
+
+void test_vmspace_fault_fails_while_vmspace_is_locked() {
+  vmspace_region_t r;
+  uintptr_t a = vmspace_alloc_lazy(&vms, &r, 0x4000, PAGE_WRITE, 0, 0);
+
+  spinlock_acquire(&vms.lock);
+  TEST_ASSERT_EQUAL_INT(-1, vmspace_handle_fault(a, 0));
+  spinlock_release(&vms.lock);
+  spinlock_acquire(&all_vmspaces_lock);
+  TEST_ASSERT_EQUAL_INT(-1, vmspace_handle_fault(a, 0));
+  spinlock_release(&all_vmspaces_lock);
+  TEST_ASSERT_FALSE(is_backed(a));
+
+  TEST_ASSERT_EQUAL_INT(0, vmspace_handle_fault(a, 0));
+}
+
+void test_vmspace_free_lazy_releases_backed_pages() {
+  vmspace_region_t r;
+  uintptr_t a = vmspace_alloc_lazy(&vms, &r, 0x10000, PAGE_WRITE, 0, 1);
+
+  vmspace_handle_fault(a, 0);
+  vmspace_handle_fault(a + 0x8000, 0);
+  TEST_ASSERT_EQUAL_UINT(base + 4, nallocated);
+
+  vmspace_free_lazy(&r);
+  TEST_ASSERT_EQUAL_UINT(base, nallocated);
+  TEST_ASSERT_NULL(vms.lazy);
+  TEST_ASSERT_EQUAL_INT(-1, vmspace_handle_fault(a, 0));
+  TEST_ASSERT_EQUAL_HEX32(a, vmspace_alloc(&vms, 0x10000, 0, 0));
+}
+
+/* Tree backend. */
+static vmspace_t tree;
+
+static void init_tree(unsigned policy) {
+  TEST_ASSERT_EQUAL_INT(0, vmspace_init_tree(&tree, TREE_START, TREE_SIZE,
+                                             policy));
+  base = nallocated;
+}
+
+/* Check the tree is ordered, balanced and that its gaps add up, returning
+   its height. 'prev_hi' is the end of the last region seen. */
+static int check_node(vmspace_node_t *n, uintptr_t *prev_hi) {
+  if (!n)
+    return 0;
+  int hl = check_node(n->left, prev_hi);
+
+  TEST_ASSERT_TRUE(n->lo >= *prev_hi);
+  TEST_ASSERT_EQUAL_HEX32(n->lo - *prev_hi, n->gap);
+  TEST_ASSERT_EQUAL_HEX32(n->lo + n->r.guard, n->r.start);
+  TEST_ASSERT_EQUAL_HEX32(n->r.start + n->r.size + n->r.guard, n->hi);
+  *prev_hi = n->hi;
+
+  int hr = check_node(n->right, prev_hi);
+  TEST_ASSERT_TRUE(hl - hr <= 1 && hr - hl <= 1);
+  TEST_ASSERT_EQUAL_INT(1 + (hl > hr ? hl : hr), n->height);
+
+  uintptr_t max = n->gap;
+  if (n->left && n->left->max_gap > max)
+    max = n->left->max_gap;
+  if (n->right && n->right->max_gap > max)
+    max = n->right->max_gap;
+  TEST_ASSERT_EQUAL_HEX32(max, n->max_gap);
+  return n->height;
+}
+
+static void check_tree() {
+  uintptr_t prev_hi = TREE_START;
+  check_node(tree.root, &prev_hi);
+  TEST_ASSERT_EQUAL_HEX32(TREE_START + TREE_SIZE, prev_hi);
+}
+
+static uintptr_t alloc_reserved(unsigned sz) {
+  return vmspace_alloc(&tree, sz, 0, 0);
+}
+
+void test_vmspace_tree_sizes_are_exact() {
+  init_tree(VMSPACE_NEXT_FIT);
+  uintptr_t a = alloc_reserved(0x3000);
+  uintptr_t b = alloc_reserved(0x5000);
+  uintptr_t c = alloc_reserved(0x1234);
+
+  /* The bottom page holds the tree's nodes. */
+  TEST_ASSERT_EQUAL_HEX32(TREE_START + 0x1000, a);
+  TEST_ASSERT_EQUAL_HEX32(a + 0x3000, b);
+  TEST_ASSERT_EQUAL_HEX32(b + 0x5000, c);
+  TEST_ASSERT_EQUAL_HEX32(c + 0x2000, alloc_reserved(0x1000));
+  check_tree();
+}
+
+void test_vmspace_tree_best_fit_takes_smallest_gap() {
+  init_tree(VMSPACE_BEST_FIT);
+  uintptr_t a = alloc_reserved(0x4000);
+  alloc_reserved(0x1000);
+  uintptr_t c = alloc_reserved(0x2000);
+  alloc_reserved(0x1000);
+  vmspace_free(&tree, 0x4000, a, 0);
+  vmspace_free(&tree, 0x2000, c, 0);
+  check_tree();
+
+  TEST_ASSERT_EQUAL_HEX32(c, alloc_reserved(0x2000));
+  TEST_ASSERT_EQUAL_HEX32(a, alloc_reserved(0x3000));
+  TEST_ASSERT_EQUAL_HEX32(a + 0x3000, alloc_reserved(0x1000));
+  check_tree();
+}
+
+void test_vmspace_tree_next_fit_moves_on_and_wraps() {
+  init_tree(VMSPACE_NEXT_FIT);
+  uintptr_t a = alloc_reserved(0x2000);
+  uintptr_t b = alloc_reserved(0x2000);
+  vmspace_free(&tree, 0x2000, a, 0);
+
+  TEST_ASSERT_EQUAL_HEX32(b + 0x2000, alloc_reserved(0x2000));
+
+  /* Fill the rest, and the next search has to go back to the start. */
+  uintptr_t rest = TREE_START + TREE_SIZE - (b + 0x4000);
+  TEST_ASSERT_EQUAL_HEX32(b + 0x4000, alloc_reserved(rest));
+  TEST_ASSERT_EQUAL_HEX32(a, alloc_reserved(0x2000));
+  TEST_ASSERT_EQUAL_HEX32(~0UL, alloc_reserved(0x1000));
+  check_tree();
+}
+
+void test_vmspace_tree_free_coalesces() {
+  init_tree(VMSPACE_BEST_FIT);
+  uintptr_t a[8];
+  for (unsigned i = 0; i < 8; ++i)
+    a[i] = alloc_reserved(0x1000 * (i + 1));
+  for (unsigned i = 0; i < 8; i += 2)
+    vmspace_free(&tree, 0, a[i], 0);
+  for (unsigned i = 1; i < 8; i += 2)
+    vmspace_free(&tree, 0, a[i], 0);
+  check_tree();
+
+  TEST_ASSERT_EQUAL_HEX32(TREE_START + 0x1000,
+                          alloc_reserved(TREE_SIZE - 0x1000));
+}
+
+void test_vmspace_tree_guard_pages() {
+  init_tree(VMSPACE_NEXT_FIT);
+  vmspace_region_t r = {.size = 0x2000, .guard = 0x1000,
+                        .backing = VMSPACE_LAZY, .flags = PAGE_WRITE};
+  uintptr_t a = vmspace_alloc_region(&tree, &r);
+
+  TEST_ASSERT_EQUAL_HEX32(TREE_START + 0x2000, a);
+  TEST_ASSERT_EQUAL_HEX32(a + 0x3000, alloc_reserved(0x1000));
+
+  vmspace_region_t q;
+  TEST_ASSERT_EQUAL_INT(0, vmspace_query(&tree, a - 0x1000, &q));
+  TEST_ASSERT_EQUAL_HEX32(a, q.start);
+  TEST_ASSERT_EQUAL_INT(0, vmspace_query(&tree, a + 0x2000, &q));
+  TEST_ASSERT_EQUAL_HEX32(a, q.start);
+
+  TEST_ASSERT_EQUAL_INT(-1, vmspace_handle_fault(a - 1, 0));
+  TEST_ASSERT_EQUAL_INT(-1, vmspace_handle_fault(a + 0x2000, 0));
+  TEST_ASSERT_EQUAL_INT(0, vmspace_handle_fault(a + 0x1fff, 0));
+  TEST_ASSERT_EQUAL_UINT(base + 1, nallocated);
+  check_tree();
+}
+
+void test_vmspace_tree_wired_regions_are_backed() {
+  init_tree(VMSPACE_BEST_FIT);
+  vmspace_region_t r = {.size = 0x3000, .backing = VMSPACE_WIRED,
+                        .flags = PAGE_WRITE};
+  uintptr_t a = vmspace_alloc_region(&tree, &r);
+
+  TEST_ASSERT_EQUAL_UINT(base + 3, nallocated);
+  TEST_ASSERT_TRUE(is_backed(a) && is_backed(a + 0x2000));
+
+  vmspace_free_region(&tree, a);
+  TEST_ASSERT_EQUAL_UINT(base, nallocated);
+  TEST_ASSERT_FALSE(is_backed(a));
+
+  phys_limit = nallocated + 2;
+  TEST_ASSERT_EQUAL_HEX32(~0UL, vmspace_alloc_region(&tree, &r));
+  TEST_ASSERT_EQUAL_UINT(base, nallocated);
+  check_tree();
+}
+
+void test_vmspace_tree_lazy_regions_fault_in() {
+  init_tree(VMSPACE_NEXT_FIT);
+  vmspace_region_t r;
+  uintptr_t a = vmspace_alloc_lazy(&tree, &r, 0x8000, PAGE_WRITE, 0, 1);
+
+  TEST_ASSERT_EQUAL_INT(0, vmspace_handle_fault(a + 0x4000, 0));
+  TEST_ASSERT_EQUAL_UINT(base + 2, nallocated);
+
+  vmspace_free_lazy(&r);
+  TEST_ASSERT_EQUAL_UINT(base, nallocated);
+  TEST_ASSERT_EQUAL_INT(-1, vmspace_query(&tree, a, &r));
+  check_tree();
+}
+
+void test_vmspace_tree_next_region_iterates_in_order() {
+  init_tree(VMSPACE_BEST_FIT);
+  uintptr_t a = alloc_reserved(0x1000);
+  vmspace_region_t g = {.size = 0x1000, .guard = 0x1000};
+  uintptr_t b = vmspace_alloc_region(&tree, &g);
+
+  vmspace_region_t r;
+  TEST_ASSERT_EQUAL_INT(0, vmspace_next_region(&tree, TREE_START, &r));
+  TEST_ASSERT_EQUAL_HEX32(TREE_START, r.start);
+  TEST_ASSERT_EQUAL_INT(VMSPACE_INTERNAL, r.backing);
+
+  TEST_ASSERT_EQUAL_INT(0, vmspace_next_region(&tree, r.start + r.size, &r));
+  TEST_ASSERT_EQUAL_HEX32(a, r.start);
+  TEST_ASSERT_EQUAL_INT(0, vmspace_next_region(&tree, r.start + r.size, &r));
+  TEST_ASSERT_EQUAL_HEX32(b, r.start);
+  TEST_ASSERT_EQUAL_INT(-1, vmspace_next_region(&tree, r.start + r.size, &r));
+}
+
+void test_vmspace_tree_takes_more_node_pages() {
+  init_tree(VMSPACE_NEXT_FIT);
+  unsigned per_page = 0x1000 / sizeof(vmspace_node_t);
+
+  for (unsigned i = 0; i < per_page * 2; ++i)
+    TEST_ASSERT_NOT_EQUAL(~0UL, alloc_reserved(0x1000));
+  check_tree();
+
+  unsigned internal = 0;
+  vmspace_region_t r;
+  for (uintptr_t a = TREE_START; vmspace_next_region(&tree, a, &r) == 0;
+       a = r.start + r.size)
+    internal += r.backing == VMSPACE_INTERNAL;
+  TEST_ASSERT_EQUAL_UINT(3, internal);
+  TEST_ASSERT_EQUAL_UINT(base + 2, nallocated);
+}
+
+void test_vmspace_tree_stays_consistent() {
+  init_tree(VMSPACE_BEST_FIT);
+  uintptr_t live[64] = {0};
+  srand(1);
+
+  for (unsigned i = 0; i < 4000; ++i) {
+    unsigned j = rand() % 64;
+    if (live[j]) {
+      vmspace_free(&tree, 0, live[j], 0);
+      live[j] = 0;
+    } else {
+      uintptr_t a = alloc_reserved(0x1000 * (1 + rand() % 8));
+      live[j] = (a == ~0UL) ? 0 : a;
+    }
+    if (i % 64 == 0)
+      check_tree();
+  }
+  check_tree();
+}
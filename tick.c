@@ -10,6 +10,8 @@
  * Copyright (c)2013 Ross Bamford. See LICENSE for details.
  */
 
+#include "hal.h"
+#include "slab.h"
 #include "utils.h"
 
 /* This will keep track of how many ticks that the system
@@ -27,4 +29,6 @@ void kernel_tick() {
   if (((int)jiffies) % 100 == 0) {
     printk(".");
   }
+  if (jiffies % SLAB_REAP_INTERVAL == 0)
+    slab_reap();
 }
@@ -6,8 +6,344 @@
  */
 #include "assert.h"
 #include "hal.h"
+#include "utils.h"
 #include "vmspace.h"
 
+/* Number of physical pages to request from the PMM at a time when backing
+   a new region. */
+#define BULK_BATCH 32
+
+/* Every initialised vmspace, so the page fault handler can find the one
+   owning an address. */
+static vmspace_t *all_vmspaces;
+static spinlock_t all_vmspaces_lock = SPINLOCK_RELEASED;
+
+static void unmap_pages(uintptr_t addr, unsigned sz);
+
+/* Back 'npages' pages from 'addr' with freshly allocated physical pages,
+   requested from the PMM with 'req'. The pages need not be physically
+   contiguous, so they are fetched in batches with alloc_pages_bulk() and
+   mapped one at a time. Returns -1, having undone any mappings it made, if
+   memory runs out. */
+static int map_new_pages(uintptr_t addr, size_t npages, unsigned flags,
+                         int req) {
+  uint64_t pages[BULK_BATCH];
+  uintptr_t start = addr;
+
+  while (npages > 0) {
+    size_t n = (npages < BULK_BATCH) ? npages : BULK_BATCH;
+
+    if (alloc_pages_bulk(req, n, pages) != 0)
+      goto fail;
+
+    for (size_t i = 0; i < n; ++i) {
+      if (map(addr, pages[i], 1, flags) != 0) {
+        free_pages_bulk(&pages[i], n - i);
+        goto fail;
+      }
+      addr += get_page_size();
+    }
+    npages -= n;
+  }
+  return 0;
+
+fail:
+  unmap_pages(start, addr - start);
+  return -1;
+}
+
+/* Unmap 'sz' bytes from 'addr', returning the physical pages behind them
+   to the PMM. */
+static void unmap_pages(uintptr_t addr, unsigned sz) {
+  unsigned pgsz = get_page_size();
+  for (unsigned i = 0; i < sz; i += pgsz) {
+    uint64_t p = get_mapping(addr + i, NULL);
+    assert(p != ~0ULL &&
+           "vmspace asked to free_phys but mapping did not exist!");
+    free_page(p);
+    unmap(addr + i, 1);
+  }
+}
+
+/* As unmap_pages(), but skipping pages that aren't mapped. */
+static void unmap_present_pages(uintptr_t addr, unsigned sz) {
+  unsigned pgsz = get_page_size();
+  for (unsigned i = 0; i < sz; i += pgsz) {
+    uint64_t p = get_mapping(addr + i, NULL);
+    if (p != ~0ULL) {
+      free_page(p);
+      unmap(addr + i, 1);
+    }
+  }
+}
+
+/* Tree vmspaces keep every region in an AVL tree ordered by address. Free
+   space isn't stored explicitly: each node records the gap between the
+   previous region and its own, and the largest gap in its subtree, so
+   finding room is a walk down the tree that skips subtrees with no gap
+   big enough. A zero-sized sentinel node at the end of the vmspace owns
+   the gap above the last region.
+
+   Nodes are carved out of pages taken from the vmspace itself, the first
+   node of each page recording the page as a VMSPACE_INTERNAL region.
+   Those pages are never given back. */
+typedef struct vmspace_node {
+  vmspace_region_t r;
+  uintptr_t lo, hi;             /* The region, including its guard. */
+  uintptr_t gap;                /* Free bytes between the last region and lo. */
+  uintptr_t max_gap;            /* Largest gap in this subtree. */
+  struct vmspace_node *left, *right;
+  int height;
+} vmspace_node_t;
+
+static int height(vmspace_node_t *n) {
+  return n ? n->height : 0;
+}
+
+static void update(vmspace_node_t *n) {
+  int hl = height(n->left), hr = height(n->right);
+  n->height = 1 + (hl > hr ? hl : hr);
+
+  n->max_gap = n->gap;
+  if (n->left && n->left->max_gap > n->max_gap)
+    n->max_gap = n->left->max_gap;
+  if (n->right && n->right->max_gap > n->max_gap)
+    n->max_gap = n->right->max_gap;
+}
+
+static vmspace_node_t *rotate_left(vmspace_node_t *n) {
+  vmspace_node_t *r = n->right;
+  n->right = r->left;
+  r->left = n;
+  update(n);
+  update(r);
+  return r;
+}
+
+static vmspace_node_t *rotate_right(vmspace_node_t *n) {
+  vmspace_node_t *l = n->left;
+  n->left = l->right;
+  l->right = n;
+  update(n);
+  update(l);
+  return l;
+}
+
+static vmspace_node_t *rebalance(vmspace_node_t *n) {
+  update(n);
+  int balance = height(n->left) - height(n->right);
+
+  if (balance > 1) {
+    if (height(n->left->left) < height(n->left->right))
+      n->left = rotate_left(n->left);
+    return rotate_right(n);
+  }
+  if (balance < -1) {
+    if (height(n->right->right) < height(n->right->left))
+      n->right = rotate_right(n->right);
+    return rotate_left(n);
+  }
+  return n;
+}
+
+static vmspace_node_t *tree_insert(vmspace_node_t *t, vmspace_node_t *n) {
+  if (!t) {
+    n->left = n->right = NULL;
+    update(n);
+    return n;
+  }
+  if (n->lo < t->lo)
+    t->left = tree_insert(t->left, n);
+  else
+    t->right = tree_insert(t->right, n);
+  return rebalance(t);
+}
+
+static vmspace_node_t *tree_remove_min(vmspace_node_t *t,
+                                       vmspace_node_t **min) {
+  if (!t->left) {
+    *min = t;
+    return t->right;
+  }
+  t->left = tree_remove_min(t->left, min);
+  return rebalance(t);
+}
+
+static vmspace_node_t *tree_remove(vmspace_node_t *t, uintptr_t lo) {
+  if (lo < t->lo) {
+    t->left = tree_remove(t->left, lo);
+  } else if (lo > t->lo) {
+    t->right = tree_remove(t->right, lo);
+  } else {
+    vmspace_node_t *min, *l = t->left, *r = t->right;
+    if (!r)
+      return l;
+    r = tree_remove_min(r, &min);
+    min->left = l;
+    min->right = r;
+    return rebalance(min);
+  }
+  return rebalance(t);
+}
+
+/* Recompute max_gap on the way down to the node at 'lo', after its gap
+   has changed. */
+static void tree_touch(vmspace_node_t *t, uintptr_t lo) {
+  if (lo < t->lo)
+    tree_touch(t->left, lo);
+  else if (lo > t->lo)
+    tree_touch(t->right, lo);
+  update(t);
+}
+
+/* The last node at or below 'addr', or NULL. */
+static vmspace_node_t *tree_floor(vmspace_node_t *t, uintptr_t addr) {
+  vmspace_node_t *best = NULL;
+  while (t) {
+    if (t->lo <= addr) {
+      best = t;
+      t = t->right;
+    } else {
+      t = t->left;
+    }
+  }
+  return best;
+}
+
+/* The first node above 'addr', or NULL. */
+static vmspace_node_t *tree_above(vmspace_node_t *t, uintptr_t addr) {
+  vmspace_node_t *best = NULL;
+  while (t) {
+    if (t->lo > addr) {
+      best = t;
+      t = t->left;
+    } else {
+      t = t->right;
+    }
+  }
+  return best;
+}
+
+/* The first node, in address order, with a gap of at least 'need' bytes
+   that starts at or after 'from'. Gaps start at ascending addresses, so
+   if this node's starts below 'from', none in its left subtree can do. */
+static vmspace_node_t *first_fit(vmspace_node_t *t, uintptr_t need,
+                                 uintptr_t from) {
+  if (!t || t->max_gap < need)
+    return NULL;
+
+  if (t->lo - t->gap >= from) {
+    vmspace_node_t *n = first_fit(t->left, need, from);
+    if (n)
+      return n;
+    if (t->gap >= need)
+      return t;
+  }
+  return first_fit(t->right, need, from);
+}
+
+/* The node with the smallest gap of at least 'need' bytes, the lowest
+   such on a tie. Stops looking once it finds an exact fit. */
+static void best_fit(vmspace_node_t *t, uintptr_t need,
+                     vmspace_node_t **best) {
+  if (!t || t->max_gap < need || (*best && (*best)->gap == need))
+    return;
+
+  best_fit(t->left, need, best);
+  if (t->gap >= need && (!*best || t->gap < (*best)->gap))
+    *best = t;
+  best_fit(t->right, need, best);
+}
+
+static vmspace_node_t *find_gap(vmspace_t *vms, uintptr_t need) {
+  vmspace_node_t *n = NULL;
+  if (vms->policy == VMSPACE_BEST_FIT)
+    best_fit(vms->root, need, &n);
+  else if ((n = first_fit(vms->root, need, vms->cursor)) == NULL)
+    n = first_fit(vms->root, need, vms->start);
+  return n;
+}
+
+static void put_node(vmspace_t *vms, vmspace_node_t *n) {
+  n->left = vms->spare;
+  vms->spare = n;
+}
+
+static vmspace_node_t *get_node(vmspace_t *vms) {
+  vmspace_node_t *n = vms->spare;
+  vms->spare = n->left;
+  return n;
+}
+
+/* Put 'n', 'len' bytes long, at the bottom of the gap below 'succ'. */
+static void place(vmspace_t *vms, vmspace_node_t *succ, vmspace_node_t *n,
+                  uintptr_t len) {
+  n->lo = succ->lo - succ->gap;
+  n->hi = n->lo + len;
+  n->gap = 0;
+  n->r.start = n->lo + n->r.guard;
+  succ->gap -= len;
+
+  vms->root = tree_insert(vms->root, n);
+  tree_touch(vms->root, succ->lo);
+}
+
+/* Take 'n' out of the tree, giving its space to the gap above it. There is
+   always a node above, if only the sentinel. */
+static void remove_node(vmspace_t *vms, vmspace_node_t *n) {
+  vmspace_node_t *succ = tree_above(vms->root, n->lo);
+  succ->gap += n->gap + (n->hi - n->lo);
+
+  vms->root = tree_remove(vms->root, n->lo);
+  tree_touch(vms->root, succ->lo);
+  put_node(vms, n);
+}
+
+/* Turn the page at 'addr' into tree nodes, keeping the first to describe
+   the page itself. */
+static vmspace_node_t *carve_nodes(vmspace_t *vms, uintptr_t addr) {
+  vmspace_node_t *nodes = (vmspace_node_t*)addr;
+  unsigned n = get_page_size() / sizeof(vmspace_node_t);
+
+  for (unsigned i = n - 1; i > 0; --i)
+    put_node(vms, &nodes[i]);
+
+  nodes[0].r = (vmspace_region_t) {
+    .size = get_page_size(),
+    .backing = VMSPACE_INTERNAL,
+    .flags = PAGE_WRITE,
+    .vms = vms,
+  };
+  return &nodes[0];
+}
+
+/* Make sure there's a spare node, mapping a new page of them from the
+   lowest gap if need be. Call with the lock held. */
+static int ensure_spare(vmspace_t *vms) {
+  if (vms->spare)
+    return 0;
+
+  vmspace_node_t *succ = first_fit(vms->root, get_page_size(), vms->start);
+  if (!succ)
+    return -1;
+
+  uintptr_t addr = succ->lo - succ->gap;
+  if (map_new_pages(addr, 1, PAGE_WRITE, PAGE_REQ_NONE) == -1)
+    return -1;
+
+  place(vms, succ, carve_nodes(vms, addr), get_page_size());
+  return 0;
+}
+
+/* The tree node for the region starting at 'addr'. Call with the lock
+   held. */
+static vmspace_node_t *region_at(vmspace_t *vms, uintptr_t addr) {
+  vmspace_node_t *n = tree_floor(vms->root, addr);
+  assert(n && n->r.start == addr && n->r.backing != VMSPACE_INTERNAL &&
+         "No vmspace region starts at that address!");
+  return n;
+}
+
 int vmspace_init(vmspace_t *vms, uintptr_t addr, uintptr_t sz) {
   /* FIXME: Assert starts and finishes on a page boundary! */
   range_t r;
@@ -16,16 +352,17 @@ int vmspace_init(vmspace_t *vms, uintptr_t addr, uintptr_t sz) {
 
   vms->start = addr;
   vms->size = sz;
+  vms->policy = VMSPACE_BUDDY;
+  vms->root = vms->spare = NULL;
+  vms->lazy = NULL;
   spinlock_init(&vms->lock);
 
   size_t overhead = round_to_page_size(buddy_calc_overhead(r));
   size_t npages = overhead >> get_page_shift();
   uintptr_t start = r.start + r.extent - overhead;
 
-  int ok = map(start,
-               alloc_pages(PAGE_REQ_NONE, npages), npages,
-               PAGE_WRITE);
-  assert(ok == 0 && "map() failed in vmspace_init!");
+  if (map_new_pages(start, npages, PAGE_WRITE, PAGE_REQ_NONE) == -1)
+    return -1;
 
   r.extent -= overhead;
 
@@ -33,27 +370,129 @@ int vmspace_init(vmspace_t *vms, uintptr_t addr, uintptr_t sz) {
 
   buddy_free_range(&vms->allocator, r);
 
+  spinlock_acquire(&all_vmspaces_lock);
+  vms->next = all_vmspaces;
+  all_vmspaces = vms;
+  spinlock_release(&all_vmspaces_lock);
+
   return 0;
 }
 
-uintptr_t vmspace_alloc(vmspace_t *vms, unsigned sz, int alloc_phys) {
-  /* FIXME: Assert sz is page aligned. */
+int vmspace_init_tree(vmspace_t *vms, uintptr_t addr, uintptr_t sz,
+                      unsigned policy) {
+  assert(policy != VMSPACE_BUDDY && addr + sz > addr &&
+         "Bad tree vmspace!");
+
+  vms->start = addr;
+  vms->size = sz;
+  vms->policy = policy;
+  vms->root = vms->spare = NULL;
+  vms->cursor = addr;
+  vms->lazy = NULL;
+  spinlock_init(&vms->lock);
+
+  /* The first page of nodes goes at the bottom, and the sentinel (one of
+     those nodes) starts out owning everything above it. */
+  if (map_new_pages(addr, 1, PAGE_WRITE, PAGE_REQ_NONE) == -1)
+    return -1;
+
+  vmspace_node_t *first = carve_nodes(vms, addr);
+  vmspace_node_t *end = get_node(vms);
+  end->r = (vmspace_region_t) {
+    .start = addr + sz,
+    .backing = VMSPACE_INTERNAL,
+    .vms = vms,
+  };
+  end->lo = end->hi = addr + sz;
+  end->gap = sz;
+  vms->root = tree_insert(NULL, end);
+  place(vms, end, first, get_page_size());
+
+  spinlock_acquire(&all_vmspaces_lock);
+  vms->next = all_vmspaces;
+  all_vmspaces = vms;
+  spinlock_release(&all_vmspaces_lock);
+
+  return 0;
+}
+
+uintptr_t vmspace_alloc_region(vmspace_t *vms, vmspace_region_t *r) {
+  assert(vms->policy != VMSPACE_BUDDY &&
+         "vmspace_alloc_region needs a tree vmspace!");
+
+  uintptr_t size = round_to_page_size(r->size);
+  uintptr_t guard = round_to_page_size(r->guard);
+  uintptr_t len = size + 2 * guard;
+  if (size == 0 || len < size)
+    return ~0UL;
+
   spinlock_acquire(&vms->lock);
 
-  uint64_t addr = buddy_alloc(&vms->allocator, sz);
+  vmspace_node_t *succ;
+  if (ensure_spare(vms) == -1 || (succ = find_gap(vms, len)) == NULL) {
+    spinlock_release(&vms->lock);
+    return ~0UL;
+  }
+
+  vmspace_node_t *n = get_node(vms);
+  n->r = *r;
+  n->r.size = size;
+  n->r.guard = guard;
+  n->r.vms = vms;
+  n->r.next = NULL;
+  place(vms, succ, n, len);
+
+  if (n->r.backing == VMSPACE_WIRED &&
+      map_new_pages(n->r.start, size >> get_page_shift(), n->r.flags,
+                    n->r.req) == -1) {
+    remove_node(vms, n);
+    spinlock_release(&vms->lock);
+    return ~0UL;
+  }
+
+  vms->cursor = n->hi;
+  r->start = n->r.start;
+  r->size = size;
+  r->guard = guard;
+  r->vms = vms;
+
+  spinlock_release(&vms->lock);
+  return r->start;
+}
+
+void vmspace_free_region(vmspace_t *vms, uintptr_t addr) {
+  spinlock_acquire(&vms->lock);
+
+  vmspace_node_t *n = region_at(vms, addr);
+  if (n->r.backing == VMSPACE_WIRED)
+    unmap_pages(addr, n->r.size);
+  else if (n->r.backing == VMSPACE_LAZY)
+    unmap_present_pages(addr, n->r.size);
+  remove_node(vms, n);
 
-  if (alloc_phys && addr != ~0ULL) {
-    size_t npages = sz >> get_page_shift();
-    uintptr_t phys_pages = alloc_pages(PAGE_REQ_NONE, npages);
+  spinlock_release(&vms->lock);
+}
+
+uintptr_t vmspace_alloc(vmspace_t *vms, unsigned sz, int alloc_phys, int req) {
+  if (vms->policy != VMSPACE_BUDDY) {
+    vmspace_region_t r = {
+      .size = sz,
+      .backing = alloc_phys ? VMSPACE_WIRED : VMSPACE_RESERVED,
+      .flags = alloc_phys,
+      .req = req,
+    };
+    return vmspace_alloc_region(vms, &r);
+  }
+
+  /* FIXME: Assert sz is page aligned. */
+  spinlock_acquire(&vms->lock);
 
-#if CPUBITS == 64
-    assert(phys_pages != ~0UL && phys_pages != ~0ULL && "Out of memory!");
-#elif CPUBITS == 32
-    assert(phys_pages != ~0UL && "Out of memory!");
-#endif
+  uint64_t addr = buddy_alloc(&vms->allocator, sz);
 
-    int ok = map(addr, phys_pages, npages, alloc_phys);
-    assert(ok == 0 && "vmspace_alloc: map failed!");
+  if (alloc_phys && addr != ~0ULL &&
+      map_new_pages(addr, sz >> get_page_shift(), alloc_phys, req) == -1) {
+    buddy_free(&vms->allocator, addr, sz);
+    addr = ~0ULL;
   }
 
   spinlock_release(&vms->lock);
@@ -63,18 +502,191 @@ uintptr_t vmspace_alloc(vmspace_t *vms, unsigned sz, int alloc_phys) {
 void vmspace_free(vmspace_t *vms, unsigned sz, uintptr_t addr, int free_phys) {
   spinlock_acquire(&vms->lock);
 
-  if (free_phys) {
-    unsigned pgsz = get_page_size();
-    for (unsigned i = 0; i < sz; i += pgsz) {
-      uint64_t p = get_mapping(addr + i, NULL);
-      assert(p != ~0ULL &&
-             "vmspace_free asked to free_phys but mapping did not exist!");
-      free_page(p);
-      unmap(addr + i, 1);
+  if (free_phys)
+    unmap_pages(addr, sz);
+
+  if (vms->policy != VMSPACE_BUDDY)
+    remove_node(vms, region_at(vms, addr));
+  else
+    buddy_free(&vms->allocator, addr, sz);
+
+  spinlock_release(&vms->lock);
+}
+
+int vmspace_map(vmspace_t *vms, uintptr_t addr, unsigned sz, unsigned flags,
+                int req) {
+  spinlock_acquire(&vms->lock);
+  int ret = map_new_pages(addr, sz >> get_page_shift(), flags, req);
+  spinlock_release(&vms->lock);
+  return ret;
+}
+
+void vmspace_unmap(vmspace_t *vms, uintptr_t addr, unsigned sz) {
+  spinlock_acquire(&vms->lock);
+  unmap_pages(addr, sz);
+  spinlock_release(&vms->lock);
+}
+
+uintptr_t vmspace_alloc_lazy(vmspace_t *vms, vmspace_region_t *r, unsigned sz,
+                             unsigned flags, int req, unsigned prefault) {
+  r->size = sz;
+  r->guard = 0;
+  r->backing = VMSPACE_LAZY;
+  r->flags = flags;
+  r->req = req;
+  r->prefault = prefault;
+
+  /* Tree vmspaces keep the region in the tree. */
+  if (vms->policy != VMSPACE_BUDDY)
+    return vmspace_alloc_region(vms, r);
+
+  uintptr_t addr = vmspace_alloc(vms, sz, 0, 0);
+  if (addr == ~0UL)
+    return addr;
+
+  r->start = addr;
+  r->vms = vms;
+
+  spinlock_acquire(&vms->lock);
+  r->next = vms->lazy;
+  vms->lazy = r;
+  spinlock_release(&vms->lock);
+  return addr;
+}
+
+void vmspace_free_lazy(vmspace_region_t *r) {
+  vmspace_t *vms = r->vms;
+  if (vms->policy != VMSPACE_BUDDY) {
+    vmspace_free_region(vms, r->start);
+    return;
+  }
+
+  spinlock_acquire(&vms->lock);
+
+  vmspace_region_t **pr = &vms->lazy;
+  while (*pr != r)
+    pr = &(*pr)->next;
+  *pr = r->next;
+
+  unmap_present_pages(r->start, r->size);
+  buddy_free(&vms->allocator, r->start, r->size);
+
+  spinlock_release(&vms->lock);
+}
+
+/* Back whichever pages from 'addr' up to 'end' aren't already, a run of
+   unbacked pages at a time. Call with the vmspace lock held. */
+static int fault_in(vmspace_region_t *r, uintptr_t addr, uintptr_t end) {
+  unsigned pgsz = get_page_size();
+
+  while (addr < end) {
+    if (get_mapping(addr, NULL) != ~0ULL) {
+      addr += pgsz;
+      continue;
     }
+
+    uintptr_t run = addr + pgsz;
+    while (run < end && get_mapping(run, NULL) == ~0ULL)
+      run += pgsz;
+    if (map_new_pages(addr, (run - addr) >> get_page_shift(), r->flags,
+                      r->req) == -1)
+      return -1;
+    addr = run;
   }
+  return 0;
+}
 
-  buddy_free(&vms->allocator, addr, sz);
+/* The region containing 'addr', guard pages and all, or NULL. Buddy
+   vmspaces only know about their demand-paged regions. Call with the lock
+   held. */
+static vmspace_region_t *find_region(vmspace_t *vms, uintptr_t addr) {
+  if (vms->policy != VMSPACE_BUDDY) {
+    /* The sentinel starts at the end, so can't be the floor of an address
+       in the vmspace. */
+    vmspace_node_t *n = tree_floor(vms->root, addr);
+    return (n && addr < n->hi) ? &n->r : NULL;
+  }
+
+  for (vmspace_region_t *r = vms->lazy; r; r = r->next)
+    if (addr >= r->start && addr - r->start < r->size)
+      return r;
+  return NULL;
+}
+
+int vmspace_handle_fault(uintptr_t addr, int user) {
+  vmspace_t *vms;
+
+  /* The fault may have come from code holding either lock - waiting for
+     it would deadlock, so treat a busy lock as an unhandled fault. */
+  if (!spinlock_try_acquire(&all_vmspaces_lock))
+    return -1;
+  for (vms = all_vmspaces; vms; vms = vms->next)
+    if (addr >= vms->start && addr - vms->start < vms->size)
+      break;
+  spinlock_release(&all_vmspaces_lock);
+
+  if (!vms || !spinlock_try_acquire(&vms->lock))
+    return -1;
+
+  vmspace_region_t *r = find_region(vms, addr);
+
+  if (r && addr - r->start >= r->size)
+    printk("vmspace: fault on a guard page of the region at %x\n",
+           r->start);
+
+  if (!r || addr - r->start >= r->size || r->backing != VMSPACE_LAZY ||
+      (user && !(r->flags & PAGE_USER))) {
+    spinlock_release(&vms->lock);
+    return -1;
+  }
+
+  /* Another CPU may have got here first, in which case fault_in() has
+     nothing to do. The page that faulted must be backed; the ones after
+     it are a bonus. */
+  uintptr_t page = addr & ~((uintptr_t)get_page_size() - 1);
+  uintptr_t npages = (r->start + r->size - page) >> get_page_shift();
+  if (npages > r->prefault + 1)
+    npages = r->prefault + 1;
+
+  int ret = fault_in(r, page, page + get_page_size());
+  if (ret == 0)
+    fault_in(r, page + get_page_size(),
+             page + (npages << get_page_shift()));
+
+  spinlock_release(&vms->lock);
+  return ret;
+}
+
+int vmspace_query(vmspace_t *vms, uintptr_t addr, vmspace_region_t *out) {
+  spinlock_acquire(&vms->lock);
+  vmspace_region_t *r = find_region(vms, addr);
+  if (r)
+    *out = *r;
+  spinlock_release(&vms->lock);
+  return r ? 0 : -1;
+}
+
+int vmspace_next_region(vmspace_t *vms, uintptr_t addr,
+                        vmspace_region_t *out) {
+  vmspace_region_t *r = NULL;
+  spinlock_acquire(&vms->lock);
+
+  if (vms->policy != VMSPACE_BUDDY) {
+    /* 'addr' may be in the guard below a region; if not, it's the region
+       above. Regions are never empty, so the sentinel marks the end. */
+    vmspace_node_t *n = tree_floor(vms->root, addr);
+    if (!n || n->r.start < addr)
+      n = tree_above(vms->root, addr);
+    if (n && n->r.size)
+      r = &n->r;
+  } else {
+    for (vmspace_region_t *l = vms->lazy; l; l = l->next)
+      if (l->start >= addr && (!r || l->start < r->start))
+        r = l;
+  }
 
+  if (r)
+    *out = *r;
   spinlock_release(&vms->lock);
+  return r ? 0 : -1;
 }